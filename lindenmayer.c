@@ -1,16 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "lindenmayer.h"
 
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The expansion has kernels for x86 vector instructions, which are only used
+// when the processor running the program has them
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_EXPANSION
+#include <immintrin.h>
+#endif
 
 #define PI 3.14159265359
 
-void initialize_dragon_curve(lindenmayer_system *p_lsystem)
+// Number of symbols of a path that are expanded by a thread at a time
+#define EXPAND_BLOCK_SIZE 65536
+
+// Longest expansion of a rule that is kept in a lindenmayer_cache
+#define CACHE_BLOCK_SIZE 65536
+
+// Largest size of all the powers of the rules kept in the compiled form and
+// highest power kept, which is the most iterations expanded in a single pass
+#define RULE_POWER_BUDGET 65536
+#define MAX_RULE_POWER 8
+
+// Most headings kept in the table of a system whose angle divides the full turn
+#define MAX_HEADINGS 360
+
+
+// Width of the loads and stores of the vector kernels, which may read past
+// the end of a rule (the rule storage is padded for them)
+#define SIMD_WIDTH 32
+
+// Start a system without rules, productions or forward symbols
+static void initialize_rules(lindenmayer_system *p_lsystem)
 {
 	for (int i = 0; i < 256; ++i) {
 		p_lsystem->rules[i] = NULL;
 		p_lsystem->is_forward[i] = 0;
+		p_lsystem->n_productions[i] = 0;
+		p_lsystem->productions[i] = NULL;
+		p_lsystem->weights[i] = NULL;
+		p_lsystem->n_context_rules[i] = 0;
+		p_lsystem->left_contexts[i] = NULL;
+		p_lsystem->right_contexts[i] = NULL;
+		p_lsystem->context_rules[i] = NULL;
 	}
+	p_lsystem->is_stochastic = 0;
+	p_lsystem->seed = 0;
+	p_lsystem->is_context_sensitive = 0;
+	p_lsystem->rule_lengths = NULL;
+	p_lsystem->rule_offsets = NULL;
+	p_lsystem->rule_storage = NULL;
+	p_lsystem->heading_x = NULL;
+	p_lsystem->heading_y = NULL;
+	p_lsystem->heading_terms = NULL;
+	p_lsystem->heading_fixed = NULL;
+	p_lsystem->direction_x = NULL;
+	p_lsystem->direction_y = NULL;
+}
+
+void initialize_dragon_curve(lindenmayer_system *p_lsystem)
+{
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'X'] = malloc(6 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'X'], "X+YF+");
 	p_lsystem->rules[(int)'Y'] = malloc(6 * sizeof(char));
@@ -19,28 +76,24 @@ void initialize_dragon_curve(lindenmayer_system *p_lsystem)
 	strcpy(p_lsystem->start, "FX");
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->angle = PI / 2;
+	compile_lsystem(p_lsystem);
 }
 
 void initialize_koch_curve(lindenmayer_system *p_lsystem)
 {
-	for (int i = 0; i < 256; ++i) {
-		p_lsystem->rules[i] = NULL;
-		p_lsystem->is_forward[i] = 0;
-	}
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'F'] = malloc(10 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'F'], "F+F-F-F+F");
 	p_lsystem->start = malloc(2 * sizeof(char));
 	strcpy(p_lsystem->start, "F");
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->angle = PI / 2;
+	compile_lsystem(p_lsystem);
 }
 
 void initialize_sierpinsky_triangle(lindenmayer_system *p_lsystem)
 {
-	for (int i = 0; i < 256; ++i) {
-		p_lsystem->rules[i] = NULL;
-		p_lsystem->is_forward[i] = 0;
-	}
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'F'] = malloc(10 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'F'], "F-G+F+G-F");
 	p_lsystem->rules[(int)'G'] = malloc(3 * sizeof(char));
@@ -50,14 +103,12 @@ void initialize_sierpinsky_triangle(lindenmayer_system *p_lsystem)
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->is_forward[(int)'G'] = 1;
 	p_lsystem->angle = PI * 2 / 3;
+	compile_lsystem(p_lsystem);
 }
 
 void initialize_quadratic_gosper(lindenmayer_system *p_lsystem)
 {
-	for (int i = 0; i < 256; ++i) {
-		p_lsystem->rules[i] = NULL;
-		p_lsystem->is_forward[i] = 0;
-	}
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'X'] = malloc(68 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'X'], "XFX-YF-YF+FX+FX-YF-YFFX+YF+FXFXYF-FX+YF+FXFX+YF-FXYF-YF-FX+FX+YFYF-");
 	p_lsystem->rules[(int)'Y'] = malloc(68 * sizeof(char));
@@ -66,76 +117,1566 @@ void initialize_quadratic_gosper(lindenmayer_system *p_lsystem)
 	strcpy(p_lsystem->start, "-YF");
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->angle = PI / 2;
+	compile_lsystem(p_lsystem);
 }
 
 void initialize_levy_curve(lindenmayer_system *p_lsystem)
 {
-	for (int i = 0; i < 256; ++i) {
-		p_lsystem->rules[i] = NULL;
-		p_lsystem->is_forward[i] = 0;
-	}
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'F'] = malloc(7 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'F'], "-F++F-");
 	p_lsystem->start = malloc(11 * sizeof(char));
 	strcpy(p_lsystem->start, "F++F++F++F");
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->angle = PI / 4;
+	compile_lsystem(p_lsystem);
 }
 
 void initialize_pentaplexity(lindenmayer_system *p_lsystem)
 {
-	for (int i = 0; i < 256; ++i) {
-		p_lsystem->rules[i] = NULL;
-		p_lsystem->is_forward[i] = 0;
-	}
+	initialize_rules(p_lsystem);
 	p_lsystem->rules[(int)'F'] = malloc(19 * sizeof(char));
 	strcpy(p_lsystem->rules[(int)'F'], "F++F++F+++++F-F++F");
 	p_lsystem->start = malloc(14 * sizeof(char));
 	strcpy(p_lsystem->start, "F++F++F++F++F");
 	p_lsystem->is_forward[(int)'F'] = 1;
 	p_lsystem->angle = PI / 5;
+	compile_lsystem(p_lsystem);
+}
+
+void initialize_fractal_plant(lindenmayer_system *p_lsystem)
+{
+	initialize_rules(p_lsystem);
+	p_lsystem->rules[(int)'X'] = malloc(23 * sizeof(char));
+	strcpy(p_lsystem->rules[(int)'X'], "F+[[X]-X]-F[-FX]+X");
+	p_lsystem->rules[(int)'F'] = malloc(3 * sizeof(char));
+	strcpy(p_lsystem->rules[(int)'F'], "FF");
+	p_lsystem->start = malloc(2 * sizeof(char));
+	strcpy(p_lsystem->start, "X");
+	p_lsystem->is_forward[(int)'F'] = 1;
+	p_lsystem->angle = PI / 7;
+	compile_lsystem(p_lsystem);
 }
 
+void initialize_stochastic_plant(lindenmayer_system *p_lsystem)
+{
+	initialize_rules(p_lsystem);
+	add_production(p_lsystem, 'F', "F[+F]F[-F]F", 1);
+	add_production(p_lsystem, 'F', "F[+F]F", 1);
+	add_production(p_lsystem, 'F', "F[-F]F", 1);
+	p_lsystem->start = malloc(2 * sizeof(char));
+	strcpy(p_lsystem->start, "F");
+	p_lsystem->is_forward[(int)'F'] = 1;
+	p_lsystem->angle = PI / 7;
+	p_lsystem->seed = 0x5eed;
+	compile_lsystem(p_lsystem);
+}
+
+void initialize_context_koch_curve(lindenmayer_system *p_lsystem)
+{
+	initialize_rules(p_lsystem);
+	p_lsystem->rules[(int)'F'] = malloc(10 * sizeof(char));
+	strcpy(p_lsystem->rules[(int)'F'], "F+F-F-F+F");
+	// The segments right after a left turn bend the other way
+	add_context_production(p_lsystem, '+', 'F', '\0', "F-F+F+F-F");
+	p_lsystem->start = malloc(8 * sizeof(char));
+	strcpy(p_lsystem->start, "F+F+F+F");
+	p_lsystem->is_forward[(int)'F'] = 1;
+	p_lsystem->angle = PI / 2;
+	compile_lsystem(p_lsystem);
+}
+
+void add_production(lindenmayer_system *p_lsystem, char c, char *rule, int weight)
+{
+	int i = (uint8_t)c;
+	int n = p_lsystem->n_productions[i]++;
+	p_lsystem->productions[i] = realloc(p_lsystem->productions[i],
+	                                    (n + 1) * sizeof(char *));
+	p_lsystem->weights[i] = realloc(p_lsystem->weights[i], (n + 1) * sizeof(int));
+	p_lsystem->productions[i][n] = malloc((strlen(rule) + 1) * sizeof(char));
+	strcpy(p_lsystem->productions[i][n], rule);
+	p_lsystem->weights[i][n] = (n == 0 ? 0 : p_lsystem->weights[i][n - 1]) + weight;
+	p_lsystem->rules[i] = p_lsystem->productions[i][0];
+	if (n > 0) p_lsystem->is_stochastic = 1;
+}
+
+void add_context_production(lindenmayer_system *p_lsystem, char left, char c,
+	char right, char *rule)
+{
+	int i = (uint8_t)c;
+	int n = p_lsystem->n_context_rules[i]++;
+	p_lsystem->left_contexts[i] = realloc(p_lsystem->left_contexts[i], (n + 1) * sizeof(char));
+	p_lsystem->right_contexts[i] = realloc(p_lsystem->right_contexts[i], (n + 1) * sizeof(char));
+	p_lsystem->context_rules[i] = realloc(p_lsystem->context_rules[i], (n + 1) * sizeof(char *));
+	p_lsystem->left_contexts[i][n] = left;
+	p_lsystem->right_contexts[i][n] = right;
+	p_lsystem->context_rules[i][n] = malloc((strlen(rule) + 1) * sizeof(char));
+	strcpy(p_lsystem->context_rules[i][n], rule);
+	p_lsystem->is_context_sensitive = 1;
+}
+
+char *choose_context_rule(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int64_t i)
+{
+	int c = (uint8_t)path[i];
+	char left = i > 0 ? path[i - 1] : '\0';
+	char right = i + 1 < path_len ? path[i + 1] : '\0';
+	for (int k = 0; k < p_lsystem->n_context_rules[c]; ++k) {
+		if ((p_lsystem->left_contexts[c][k] == '\0' || p_lsystem->left_contexts[c][k] == left) &&
+		    (p_lsystem->right_contexts[c][k] == '\0' || p_lsystem->right_contexts[c][k] == right)) {
+			return p_lsystem->context_rules[c][k];
+		}
+	}
+	return p_lsystem->rules[c];
+}
+
+// Finalizer of splitmix64, which turns consecutive inputs into unrelated ones
+static uint64_t mix_bits(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+uint64_t derivation_node(uint64_t parent, int64_t position)
+{
+	return mix_bits(parent ^ mix_bits(position + 1));
+}
+
+char *choose_production(lindenmayer_system *p_lsystem, char c, uint64_t node)
+{
+	int i = (uint8_t)c;
+	int n = p_lsystem->n_productions[i];
+	if (n <= 1) return p_lsystem->rules[i];
+	int r = mix_bits(node) % p_lsystem->weights[i][n - 1];
+	int k = 0;
+	while (r >= p_lsystem->weights[i][k]) ++k;
+	return p_lsystem->productions[i][k];
+}
+
+// Advance the table of expanded lengths of every symbol by one iteration
+static void next_expanded_lengths(lindenmayer_system *p_lsystem, int64_t *lengths)
+{
+	int64_t next_lengths[256];
+	for (int c = 0; c < 256; ++c) {
+		if (p_lsystem->rules[c] == NULL) {
+			next_lengths[c] = 1;
+			continue;
+		}
+		next_lengths[c] = 0;
+		for (int k = 0; p_lsystem->rules[c][k] != '\0'; ++k) {
+			next_lengths[c] += lengths[(int)p_lsystem->rules[c][k]];
+		}
+	}
+	memcpy(lengths, next_lengths, sizeof(next_lengths));
+}
+
+// Return the given cosine or sine of a multiple of the angle, rounded if it is
+// close to a multiple of 1/2. By Niven's theorem these are the only rational
+// values it can have, which become exact this way.
+static double round_to_rational(double value)
+{
+	double rounded = floor(2 * value + 0.5) / 2;
+	return fabs(value - rounded) < 1e-9 ? rounded : value;
+}
+
+// Store in coefficients (m + 1 entries) the cyclotomic polynomial of order m,
+// whose roots are the primitive m-th roots of unity, and return its degree. It
+// is x^m - 1 divided by the ones of the smaller divisors of m.
+static int cyclotomic_polynomial(int m, int64_t *coefficients)
+{
+	int64_t remainder[EXACT_MAX_HEADINGS + 1];
+	int64_t divisor[EXACT_MAX_HEADINGS + 1];
+	int degree = m;
+	for (int i = 0; i <= m; ++i) remainder[i] = 0;
+	remainder[0] = -1;
+	remainder[m] = 1;
+	for (int d = 1; d < m; ++d) {
+		if (m % d != 0) continue;
+		// The divisor is monic and divides exactly
+		int divisor_degree = cyclotomic_polynomial(d, divisor);
+		for (int i = 0; i <= m; ++i) coefficients[i] = 0;
+		for (int i = degree; i >= divisor_degree; --i) {
+			int64_t q = remainder[i];
+			coefficients[i - divisor_degree] = q;
+			for (int k = 0; k <= divisor_degree; ++k) {
+				remainder[i - divisor_degree + k] -= q * divisor[k];
+			}
+		}
+		degree -= divisor_degree;
+		memcpy(remainder, coefficients, (degree + 1) * sizeof(int64_t));
+	}
+	memcpy(coefficients, remainder, (degree + 1) * sizeof(int64_t));
+	return degree;
+}
+
+static fixed_point to_fixed_point(double x)
+{
+	fixed_point a;
+	double whole = floor(x);
+	// The fraction of a tiny negative number rounds up to 1
+	double fraction = x - whole < 1 ? ldexp(x - whole, 64) : 0;
+	a.whole = (int64_t)(x - whole < 1 ? whole : whole + 1);
+	a.fraction = (uint64_t)fraction;
+	return a;
+}
+
+// Add n times a to the fixed point sum, which wraps around like whole numbers
+static void add_fixed_multiple(fixed_point *p_sum, int64_t n, fixed_point a)
+{
+	// Multiply the fraction by n as unsigned 64-bit numbers in 32-bit halves,
+	// then take 2^64 times the fraction back if n is negative
+	uint64_t u = (uint64_t)n;
+	uint64_t u_low = u & 0xffffffff, u_high = u >> 32;
+	uint64_t f_low = a.fraction & 0xffffffff, f_high = a.fraction >> 32;
+	uint64_t low_low = u_low * f_low;
+	uint64_t middle = (low_low >> 32) + (u_high * f_low & 0xffffffff) + u_low * f_high;
+	uint64_t low = (middle << 32) | (low_low & 0xffffffff);
+	uint64_t high = u_high * f_high + (u_high * f_low >> 32) + (middle >> 32);
+	if (n < 0) high -= a.fraction;
+	high += u * (uint64_t)a.whole;
+	p_sum->fraction += low;
+	high += p_sum->fraction < low;
+	p_sum->whole = (int64_t)((uint64_t)p_sum->whole + high);
+}
+
+// The unit vector of heading h is z^h, where z is a primitive n_headings-th
+// root of unity. As the cyclotomic polynomial of degree n_terms is zero at z,
+// every power of z is a whole combination of the first n_terms ones, found by
+// replacing z^n_terms by the lower powers while multiplying by z.
+static void compute_heading_terms(lindenmayer_system *p_lsystem)
+{
+	int n_headings = p_lsystem->n_headings;
+	free(p_lsystem->heading_terms);
+	free(p_lsystem->heading_fixed);
+	p_lsystem->heading_terms = NULL;
+	p_lsystem->heading_fixed = NULL;
+	p_lsystem->n_terms = 0;
+	if (n_headings == 0 || n_headings > EXACT_MAX_HEADINGS) return;
+	int64_t polynomial[EXACT_MAX_HEADINGS + 1];
+	int n_terms = cyclotomic_polynomial(n_headings, polynomial);
+	if (n_terms > EXACT_MAX_TERMS) return;
+
+	p_lsystem->n_terms = n_terms;
+	p_lsystem->heading_terms = malloc(n_headings * n_terms * sizeof(int64_t));
+	int64_t terms[EXACT_MAX_TERMS] = {1};
+	for (int h = 0; h < n_headings; ++h) {
+		memcpy(&p_lsystem->heading_terms[h * n_terms], terms, n_terms * sizeof(int64_t));
+		int64_t top = terms[n_terms - 1];
+		for (int k = n_terms - 1; k > 0; --k) terms[k] = terms[k - 1] - top * polynomial[k];
+		terms[0] = -top * polynomial[0];
+	}
+
+	// The steps in fixed point are the same whole combinations of those of
+	// the first headings, so that they add up exactly
+	fixed_point basis[2 * EXACT_MAX_TERMS];
+	for (int k = 0; k < n_terms; ++k) {
+		basis[2 * k] = to_fixed_point(p_lsystem->heading_x[k]);
+		basis[2 * k + 1] = to_fixed_point(p_lsystem->heading_y[k]);
+	}
+	p_lsystem->heading_fixed = calloc(2 * n_headings, sizeof(fixed_point));
+	for (int h = 0; h < n_headings; ++h) {
+		int64_t *row = &p_lsystem->heading_terms[h * n_terms];
+		for (int k = 0; k < n_terms; ++k) {
+			add_fixed_multiple(&p_lsystem->heading_fixed[2 * h], row[k], basis[2 * k]);
+			add_fixed_multiple(&p_lsystem->heading_fixed[2 * h + 1], row[k], basis[2 * k + 1]);
+		}
+	}
+}
+
+// The extents of a drawing must be kept along the axes, to find its box, and
+// in every direction one of them is turned to by a heading, so that a turned
+// drawing is bounded exactly. These are the multiples of the least common
+// multiple of a quarter turn and the angle, if there are few enough of them.
+static void compute_bound_directions(lindenmayer_system *p_lsystem)
+{
+	int n_headings = p_lsystem->n_headings;
+	int n_directions = BOUND_DIRECTIONS;
+	p_lsystem->direction_shift = 0;
+	if (n_headings > 0) {
+		int multiple = n_headings % 4 == 0 ? n_headings :
+		               n_headings % 2 == 0 ? 2 * n_headings : 4 * n_headings;
+		if (multiple <= MAX_BOUND_DIRECTIONS) {
+			n_directions = multiple;
+			p_lsystem->direction_shift = p_lsystem->angle > 0 ? multiple / n_headings :
+			                             -multiple / n_headings;
+		}
+	}
+	free(p_lsystem->direction_x);
+	free(p_lsystem->direction_y);
+	p_lsystem->n_directions = n_directions;
+	p_lsystem->direction_x = malloc(n_directions * sizeof(double));
+	p_lsystem->direction_y = malloc(n_directions * sizeof(double));
+	for (int k = 0; k < n_directions; ++k) {
+		p_lsystem->direction_x[k] = round_to_rational(cos(2 * PI * k / n_directions));
+		p_lsystem->direction_y[k] = round_to_rational(sin(2 * PI * k / n_directions));
+	}
+}
+
+void compile_lsystem(lindenmayer_system *p_lsystem)
+{
+	int storage_size = 0;
+	p_lsystem->n_rules = 1;
+	for (int i = 0; i < 256; ++i) {
+		if (p_lsystem->rules[i] == NULL) {
+			p_lsystem->rule_id[i] = 0;
+		} else {
+			p_lsystem->rule_id[i] = p_lsystem->n_rules++;
+			storage_size += strlen(p_lsystem->rules[i]);
+		}
+	}
+	// Power the rules as many times as their expansions fit in the budget.
+	// The rules of context sensitive systems depend on the neighbours of the
+	// symbols, so they can only be expanded once at a time.
+	int64_t lengths[256];
+	int64_t powers_size = 0;
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	p_lsystem->rule_power = 0;
+	while (p_lsystem->rule_power < MAX_RULE_POWER) {
+		next_expanded_lengths(p_lsystem, lengths);
+		int64_t size = 0;
+		for (int c = 0; c < 256; ++c) {
+			if (p_lsystem->rules[c] != NULL) size += lengths[c];
+		}
+		if (p_lsystem->rule_power > 0 && (p_lsystem->is_context_sensitive ||
+		    powers_size + size > RULE_POWER_BUDGET)) break;
+		powers_size += size;
+		++p_lsystem->rule_power;
+	}
+	int n_rules = p_lsystem->n_rules;
+	int n_entries = p_lsystem->rule_power * n_rules;
+	free(p_lsystem->rule_lengths);
+	free(p_lsystem->rule_offsets);
+	free(p_lsystem->rule_storage);
+	p_lsystem->rule_lengths = malloc(n_entries * sizeof(int));
+	p_lsystem->rule_offsets = malloc(n_entries * sizeof(int));
+	p_lsystem->rule_storage = calloc(powers_size + SIMD_WIDTH, sizeof(char));
+	int offset = 0;
+	for (int d = 1; d <= p_lsystem->rule_power; ++d) {
+		int *power_lengths = p_lsystem->rule_lengths + (d - 1) * n_rules;
+		int *power_offsets = p_lsystem->rule_offsets + (d - 1) * n_rules;
+		// Symbols without rules expand to themselves
+		power_lengths[0] = 1;
+		power_offsets[0] = 0;
+		for (int i = 0; i < 256; ++i) {
+			if (p_lsystem->rules[i] == NULL) continue;
+			int id = p_lsystem->rule_id[i];
+			power_offsets[id] = offset;
+			if (d == 1) {
+				memcpy(p_lsystem->rule_storage + offset, p_lsystem->rules[i],
+				       strlen(p_lsystem->rules[i]));
+				offset += strlen(p_lsystem->rules[i]);
+			} else {
+				// The rule expanded d times is its symbols expanded d - 1 times
+				int *last_lengths = power_lengths - n_rules;
+				int *last_offsets = power_offsets - n_rules;
+				for (int k = 0; p_lsystem->rules[i][k] != '\0'; ++k) {
+					int c_id = p_lsystem->rule_id[(uint8_t)p_lsystem->rules[i][k]];
+					if (c_id == 0) {
+						p_lsystem->rule_storage[offset++] = p_lsystem->rules[i][k];
+						continue;
+					}
+					memcpy(p_lsystem->rule_storage + offset,
+					       p_lsystem->rule_storage + last_offsets[c_id], last_lengths[c_id]);
+					offset += last_lengths[c_id];
+				}
+			}
+			power_lengths[id] = offset - power_offsets[id];
+		}
+	}
+	p_lsystem->rule_storage[powers_size] = '\0';
+
+	// Tabulate the headings if turning n_headings times makes a full turn
+	double turns = 2 * PI / fabs(p_lsystem->angle);
+	int n_headings = turns < MAX_HEADINGS + 0.5 ? (int)floor(turns + 0.5) : 0;
+	free(p_lsystem->heading_x);
+	free(p_lsystem->heading_y);
+	p_lsystem->n_headings = 0;
+	p_lsystem->heading_x = p_lsystem->heading_y = NULL;
+	if (n_headings > 0 && fabs(n_headings * fabs(p_lsystem->angle) - 2 * PI) < 1e-9) {
+		p_lsystem->n_headings = n_headings;
+		p_lsystem->heading_x = malloc(n_headings * sizeof(double));
+		p_lsystem->heading_y = malloc(n_headings * sizeof(double));
+		for (int h = 0; h < n_headings; ++h) {
+			p_lsystem->heading_x[h] = round_to_rational(cos(h * p_lsystem->angle));
+			p_lsystem->heading_y[h] = round_to_rational(sin(h * p_lsystem->angle));
+		}
+	}
+	compute_heading_terms(p_lsystem);
+	compute_bound_directions(p_lsystem);
+
+	// Give a token to every symbol of the start and of the rules
+	uint8_t used[256] = {0};
+	for (int i = 0; p_lsystem->start[i] != '\0'; ++i) used[(uint8_t)p_lsystem->start[i]] = 1;
+	for (int i = 0; i < storage_size; ++i) used[(uint8_t)p_lsystem->rule_storage[i]] = 1;
+	for (int i = 0; i < 256; ++i) {
+		if (p_lsystem->rules[i] != NULL) used[i] = 1;
+	}
+	int n_used = 0;
+	for (int i = 0; i < 256; ++i) n_used += used[i];
+	p_lsystem->n_tokens = 0;
+	for (int i = 0; i < 256; ++i) {
+		p_lsystem->token[i] = PACKED_RUN_TOKEN;
+		if (used[i] && n_used <= PACKED_MAX_TOKENS) {
+			p_lsystem->token[i] = p_lsystem->n_tokens;
+			p_lsystem->token_symbol[p_lsystem->n_tokens++] = (char)i;
+		}
+	}
+}
+
+// Remove the dead symbols from the given string, in place
+static void remove_dead_symbols(char *rule, uint8_t *is_live)
+{
+	int64_t k = 0;
+	for (int64_t j = 0; rule[j] != '\0'; ++j) {
+		if (is_live[(uint8_t)rule[j]]) rule[k++] = rule[j];
+	}
+	rule[k] = '\0';
+}
+
+void eliminate_dead_symbols(lindenmayer_system *p_lsystem)
+{
+	if (p_lsystem->is_context_sensitive) return;
+	// A symbol is live if the turtle draws it or one of its productions has a
+	// live symbol, so the live ones are found by growing them until they stop
+	uint8_t is_live[256];
+	for (int c = 0; c < 256; ++c) {
+		is_live[c] = p_lsystem->is_forward[c] || c == '+' || c == '-' ||
+		             c == '[' || c == ']';
+	}
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int c = 0; c < 256; ++c) {
+			if (is_live[c] || p_lsystem->rules[c] == NULL) continue;
+			int n = p_lsystem->n_productions[c] > 0 ? p_lsystem->n_productions[c] : 1;
+			for (int k = 0; k < n && !is_live[c]; ++k) {
+				char *rule = p_lsystem->n_productions[c] > 0 ?
+					p_lsystem->productions[c][k] : p_lsystem->rules[c];
+				for (int j = 0; rule[j] != '\0'; ++j) {
+					if (is_live[(uint8_t)rule[j]]) {
+						is_live[c] = 1;
+						changed = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+	// The productions of the dead symbols are never used again, but they are
+	// kept so that clearing the system stays the same
+	remove_dead_symbols(p_lsystem->start, is_live);
+	for (int c = 0; c < 256; ++c) {
+		if (p_lsystem->n_productions[c] > 0) {
+			for (int k = 0; k < p_lsystem->n_productions[c]; ++k) {
+				remove_dead_symbols(p_lsystem->productions[c][k], is_live);
+			}
+		} else if (p_lsystem->rules[c] != NULL) {
+			remove_dead_symbols(p_lsystem->rules[c], is_live);
+		}
+	}
+	compile_lsystem(p_lsystem);
+}
 
 void clear_lsystem(lindenmayer_system *p_lsystem)
 {
 	for (int i = 0; i < 256; ++i) {
-		if (p_lsystem->rules[i] != NULL) {
+		if (p_lsystem->n_productions[i] > 0) {
+			// The rule is the first production
+			for (int k = 0; k < p_lsystem->n_productions[i]; ++k) {
+				free(p_lsystem->productions[i][k]);
+			}
+			free(p_lsystem->productions[i]);
+			free(p_lsystem->weights[i]);
+			p_lsystem->n_productions[i] = 0;
+		} else if (p_lsystem->rules[i] != NULL) {
 			free(p_lsystem->rules[i]);
-			p_lsystem->rules[i] = NULL;
 		}
+		p_lsystem->rules[i] = NULL;
+		for (int k = 0; k < p_lsystem->n_context_rules[i]; ++k) {
+			free(p_lsystem->context_rules[i][k]);
+		}
+		free(p_lsystem->left_contexts[i]);
+		free(p_lsystem->right_contexts[i]);
+		free(p_lsystem->context_rules[i]);
+		p_lsystem->n_context_rules[i] = 0;
+		p_lsystem->left_contexts[i] = NULL;
+		p_lsystem->right_contexts[i] = NULL;
+		p_lsystem->context_rules[i] = NULL;
 	}
 	free(p_lsystem->start);
+	free(p_lsystem->rule_lengths);
+	free(p_lsystem->rule_offsets);
+	free(p_lsystem->rule_storage);
+	free(p_lsystem->heading_x);
+	free(p_lsystem->heading_y);
+	free(p_lsystem->heading_terms);
+	free(p_lsystem->heading_fixed);
+	free(p_lsystem->direction_x);
+	free(p_lsystem->direction_y);
 }
 
-char *expand_path(lindenmayer_system *p_lsystem, char *path)
+void heading_vector(lindenmayer_system *p_lsystem, int64_t heading, double *p_x,
+	double *p_y)
+{
+	int n_headings = p_lsystem->n_headings;
+	if (n_headings == 0) {
+		*p_x = cos(heading * p_lsystem->angle);
+		*p_y = sin(heading * p_lsystem->angle);
+		return;
+	}
+	int h = heading % n_headings;
+	if (h < 0) h += n_headings;
+	*p_x = p_lsystem->heading_x[h];
+	*p_y = p_lsystem->heading_y[h];
+}
+
+void add_turned_terms(lindenmayer_system *p_lsystem, int64_t *terms,
+	int64_t *turned_terms, int64_t heading)
 {
-	int new_size = 1; // 1 is for string terminator
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->rules[(int)path[i]] == NULL) ++new_size;
-		else new_size += strlen(p_lsystem->rules[(int)path[i]]);
+	int n_terms = p_lsystem->n_terms;
+	int n_headings = p_lsystem->n_headings;
+	int h = heading % n_headings;
+	if (h < 0) h += n_headings;
+	// Turning the unit vector of heading k by h gives the one of heading k + h
+	for (int k = 0; k < n_terms; ++k) {
+		if (turned_terms[k] == 0) continue;
+		int64_t *row = &p_lsystem->heading_terms[((h + k) % n_headings) * n_terms];
+		for (int i = 0; i < n_terms; ++i) terms[i] += turned_terms[k] * row[i];
 	}
-	char *new_path = malloc(new_size * sizeof(char));
-	for (int j = 0, i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->rules[(int)path[i]] == NULL) {
-			new_path[j++] = path[i];
+}
+
+// Return the length of the expansion of the i-th symbol of the path
+static int64_t context_rule_length(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int64_t i)
+{
+	char *rule = choose_context_rule(p_lsystem, path, path_len, i);
+	return rule == NULL ? 1 : strlen(rule);
+}
+
+#ifdef SIMD_EXPANSION
+// Return whether the blocks of a path can be expanded by the AVX2 kernels,
+// which look every symbol up in tables and so do not see its neighbours
+static int use_avx2_kernels(lindenmayer_system *p_lsystem)
+{
+	return !p_lsystem->is_context_sensitive && __builtin_cpu_supports("avx2");
+}
+
+// Return the size of the expansion of the symbols from begin to end of the
+// path, gathering the lengths of 8 symbols at a time
+__attribute__((target("avx2")))
+static int64_t sum_lengths_avx2(int *symbol_lengths, char *path, int64_t begin,
+	int64_t end)
+{
+	// The sums are kept in 64 bit lanes, as a block can expand past 4 GiB
+	__m256i sums = _mm256_setzero_si256();
+	int64_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256i symbols = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(path + i)));
+		__m256i lengths = _mm256_i32gather_epi32(symbol_lengths, symbols, 4);
+		sums = _mm256_add_epi64(sums, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(lengths)));
+		sums = _mm256_add_epi64(sums, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(lengths, 1)));
+	}
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, sums);
+	int64_t size = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; i < end; ++i) size += symbol_lengths[(uint8_t)path[i]];
+	return size;
+}
+
+// Write the expansion of the symbols from begin to end of the path at
+// new_path, which is block_end bytes long. The offsets of 8 symbols at a time
+// are prefix summed in registers and every rule of up to SIMD_WIDTH symbols
+// is copied with a single store, whose tail is overwritten by the next ones.
+__attribute__((target("avx2")))
+static void scatter_symbols_avx2(int *symbol_lengths, char **symbol_rules,
+	char *path, int64_t begin, int64_t end, char *new_path, int64_t block_end)
+{
+	int64_t j = 0;
+	int64_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256i symbols = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(path + i)));
+		__m256i lengths = _mm256_i32gather_epi32(symbol_lengths, symbols, 4);
+		// Inclusive prefix sum in each half, then carry the low half over
+		__m256i sums = _mm256_add_epi32(lengths, _mm256_slli_si256(lengths, 4));
+		sums = _mm256_add_epi32(sums, _mm256_slli_si256(sums, 8));
+		__m256i carry = _mm256_permute2x128_si256(sums, sums, 0x08);
+		sums = _mm256_add_epi32(sums, _mm256_shuffle_epi32(carry, 0xff));
+		int starts[8], ends[8];
+		_mm256_storeu_si256((__m256i *)starts, _mm256_sub_epi32(sums, lengths));
+		_mm256_storeu_si256((__m256i *)ends, sums);
+		for (int k = 0; k < 8; ++k) {
+			char c = path[i + k];
+			char *out = new_path + j + starts[k];
+			int len = ends[k] - starts[k];
+			if (symbol_rules[(uint8_t)c] == NULL) {
+				*out = c;
+			} else if (len <= SIMD_WIDTH && j + starts[k] + SIMD_WIDTH <= block_end) {
+				_mm256_storeu_si256((__m256i *)out,
+					_mm256_loadu_si256((__m256i *)symbol_rules[(uint8_t)c]));
+			} else {
+				memcpy(out, symbol_rules[(uint8_t)c], len);
+			}
+		}
+		j += ends[7];
+	}
+	for (; i < end; ++i) {
+		char c = path[i];
+		if (symbol_rules[(uint8_t)c] == NULL) {
+			new_path[j++] = c;
 		} else {
-			for (int k = 0; p_lsystem->rules[(int)path[i]][k] != '\0'; ++k) {
-				new_path[j++] = p_lsystem->rules[(int)path[i]][k];
+			memcpy(new_path + j, symbol_rules[(uint8_t)c], symbol_lengths[(uint8_t)c]);
+			j += symbol_lengths[(uint8_t)c];
+		}
+	}
+}
+#endif
+
+// Compute the offset at which the expansion of every block of the path for
+// the given power of the rules starts and return the size of the whole expansion
+static int64_t compute_block_offsets(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int power, int64_t *block_offsets)
+{
+	uint8_t *rule_id = p_lsystem->rule_id;
+	int *rule_lengths = p_lsystem->rule_lengths + (power - 1) * p_lsystem->n_rules;
+	int *n_context_rules = p_lsystem->n_context_rules;
+	int n_blocks = (path_len + EXPAND_BLOCK_SIZE - 1) / EXPAND_BLOCK_SIZE;
+#ifdef SIMD_EXPANSION
+	int use_avx2 = use_avx2_kernels(p_lsystem);
+	int symbol_lengths[256];
+	for (int c = 0; c < 256; ++c) symbol_lengths[c] = rule_lengths[rule_id[c]];
+#endif
+
+	#pragma omp parallel for if (n_blocks > 1)
+	for (int b = 0; b < n_blocks; ++b) {
+		int64_t end = b == n_blocks - 1 ? path_len : (int64_t)(b + 1) * EXPAND_BLOCK_SIZE;
+#ifdef SIMD_EXPANSION
+		if (use_avx2) {
+			block_offsets[b + 1] = sum_lengths_avx2(symbol_lengths, path,
+				(int64_t)b * EXPAND_BLOCK_SIZE, end);
+			continue;
+		}
+#endif
+		int64_t size = 0;
+		for (int64_t i = (int64_t)b * EXPAND_BLOCK_SIZE; i < end; ++i) {
+			if (n_context_rules[(uint8_t)path[i]] > 0) {
+				// The neighbours can be in the other blocks, which are only read
+				size += context_rule_length(p_lsystem, path, path_len, i);
+				continue;
 			}
+			size += rule_lengths[rule_id[(uint8_t)path[i]]];
 		}
+		block_offsets[b + 1] = size;
 	}
-	new_path[new_size - 1] = '\0';
+	// Exclusive prefix sum, so each block knows where its output starts
+	block_offsets[0] = 0;
+	for (int b = 0; b < n_blocks; ++b) block_offsets[b + 1] += block_offsets[b];
+	return block_offsets[n_blocks];
+}
+
+// Write the expansion of every block of the path for the given power of the
+// rules at its offset in new_path
+static void scatter_blocks(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int power, int64_t *block_offsets, char *new_path)
+{
+	uint8_t *rule_id = p_lsystem->rule_id;
+	int *rule_lengths = p_lsystem->rule_lengths + (power - 1) * p_lsystem->n_rules;
+	int *rule_offsets = p_lsystem->rule_offsets + (power - 1) * p_lsystem->n_rules;
+	int *n_context_rules = p_lsystem->n_context_rules;
+	int n_blocks = (path_len + EXPAND_BLOCK_SIZE - 1) / EXPAND_BLOCK_SIZE;
+#ifdef SIMD_EXPANSION
+	int use_avx2 = use_avx2_kernels(p_lsystem);
+	int symbol_lengths[256];
+	char *symbol_rules[256];
+	for (int c = 0; c < 256; ++c) {
+		int id = rule_id[c];
+		symbol_lengths[c] = rule_lengths[id];
+		symbol_rules[c] = id == 0 ? NULL : p_lsystem->rule_storage + rule_offsets[id];
+	}
+#endif
+
+	#pragma omp parallel for if (n_blocks > 1)
+	for (int b = 0; b < n_blocks; ++b) {
+		int64_t end = b == n_blocks - 1 ? path_len : (int64_t)(b + 1) * EXPAND_BLOCK_SIZE;
+		int64_t j = block_offsets[b];
+#ifdef SIMD_EXPANSION
+		if (use_avx2) {
+			// The stores must not spill into the next block, written concurrently
+			scatter_symbols_avx2(symbol_lengths, symbol_rules, path,
+				(int64_t)b * EXPAND_BLOCK_SIZE, end, new_path + j,
+				block_offsets[b + 1] - j);
+			continue;
+		}
+#endif
+		for (int64_t i = (int64_t)b * EXPAND_BLOCK_SIZE; i < end; ++i) {
+			if (n_context_rules[(uint8_t)path[i]] > 0) {
+				char *rule = choose_context_rule(p_lsystem, path, path_len, i);
+				if (rule == NULL) {
+					new_path[j++] = path[i];
+				} else {
+					int len = strlen(rule);
+					memcpy(new_path + j, rule, len);
+					j += len;
+				}
+				continue;
+			}
+			int id = rule_id[(uint8_t)path[i]];
+			if (id == 0) {
+				new_path[j++] = path[i];
+			} else {
+				memcpy(new_path + j, p_lsystem->rule_storage + rule_offsets[id],
+				       rule_lengths[id]);
+				j += rule_lengths[id];
+			}
+		}
+	}
+	new_path[block_offsets[n_blocks]] = '\0';
+}
+
+char *expand_path(lindenmayer_system *p_lsystem, char *path)
+{
+	int64_t path_len = strlen(path);
+	int n_blocks = (path_len + EXPAND_BLOCK_SIZE - 1) / EXPAND_BLOCK_SIZE;
+	int64_t *block_offsets = malloc((n_blocks + 1) * sizeof(int64_t));
+	int64_t new_size = compute_block_offsets(p_lsystem, path, path_len, 1, block_offsets);
+	char *new_path = malloc((new_size + 1) * sizeof(char));
+	scatter_blocks(p_lsystem, path, path_len, 1, block_offsets, new_path);
+	free(block_offsets);
 	return new_path;
 }
 
 char *expand_lsystem(lindenmayer_system *p_lsystem, int n)
 {
-	char *ans = expand_path(p_lsystem, p_lsystem->start);
-	for (int i = 1; i < n; ++i) {
-		char *tmp = ans;
-		ans = expand_path(p_lsystem, tmp);
-		free(tmp);
+	if (p_lsystem->is_stochastic) {
+		uint64_t *nodes;
+		char *ans = expand_lsystem_with_nodes(p_lsystem, n, &nodes);
+		free(nodes);
+		return ans;
+	}
+	if (p_lsystem->is_context_sensitive) {
+		// The arena is sized by the rules, which do not hold for these
+		char *ans = malloc((strlen(p_lsystem->start) + 1) * sizeof(char));
+		strcpy(ans, p_lsystem->start);
+		for (int i = 0; i < n; ++i) {
+			char *new_path = expand_path(p_lsystem, ans);
+			free(ans);
+			ans = new_path;
+		}
+		return ans;
+	}
+	lindenmayer_arena arena;
+	int64_t start_len = strlen(p_lsystem->start);
+	initialize_arena(&arena, p_lsystem, p_lsystem->start, start_len, n);
+	char *ans = expand_in_arena(p_lsystem, &arena, p_lsystem->start, start_len, n);
+	// Keep only the buffer holding the answer
+	free(ans == arena.buffers[0] ? arena.buffers[1] : arena.buffers[0]);
+	free(arena.block_offsets);
+	return ans;
+}
+
+char *expand_lsystem_with_nodes(lindenmayer_system *p_lsystem, int n,
+	uint64_t **p_nodes)
+{
+	if (!p_lsystem->is_stochastic) {
+		*p_nodes = NULL;
+		return expand_lsystem(p_lsystem, n);
+	}
+	int64_t path_len = strlen(p_lsystem->start);
+	char *path = malloc((path_len + 1) * sizeof(char));
+	uint64_t *nodes = malloc(path_len * sizeof(uint64_t));
+	strcpy(path, p_lsystem->start);
+	for (int64_t j = 0; j < path_len; ++j) nodes[j] = derivation_node(p_lsystem->seed, j);
+	for (int i = 0; i < n; ++i) {
+		// Symbols without a production keep their node, as they are not
+		// expanded it is never used
+		int64_t new_len = 0;
+		for (int64_t j = 0; j < path_len; ++j) {
+			char *rule = choose_production(p_lsystem, path[j], nodes[j]);
+			new_len += rule == NULL ? 1 : (int64_t)strlen(rule);
+		}
+		char *new_path = malloc((new_len + 1) * sizeof(char));
+		uint64_t *new_nodes = malloc(new_len * sizeof(uint64_t));
+		for (int64_t k = 0, j = 0; j < path_len; ++j) {
+			char *rule = choose_production(p_lsystem, path[j], nodes[j]);
+			if (rule == NULL) {
+				new_path[k] = path[j];
+				new_nodes[k++] = nodes[j];
+				continue;
+			}
+			for (int64_t l = 0; rule[l] != '\0'; ++l) {
+				new_path[k] = rule[l];
+				new_nodes[k++] = derivation_node(nodes[j], l);
+			}
+		}
+		new_path[new_len] = '\0';
+		free(path);
+		free(nodes);
+		path = new_path;
+		nodes = new_nodes;
+		path_len = new_len;
+	}
+	*p_nodes = nodes;
+	return path;
+}
+
+char *expand_with_halo(lindenmayer_system *p_lsystem, char *path, int64_t path_len,
+	int64_t begin, int64_t end, int n, int64_t *p_len)
+{
+	// The symbols more than n places away can not change how the chunk expands,
+	// as every production only looks at the neighbours and none is empty
+	int64_t first = begin < n ? 0 : begin - n;
+	int64_t last = end + n > path_len ? path_len : end + n;
+	int64_t segment_len = last - first;
+	char *segment = malloc((segment_len + 1) * sizeof(char));
+	memcpy(segment, path + first, segment_len);
+	segment[segment_len] = '\0';
+	begin -= first;
+	end -= first;
+	for (int i = 0; i < n; ++i) {
+		// Find where the expansion of the chunk starts and ends from the
+		// expansions of the halo
+		int64_t new_begin = 0, right_len = 0;
+		for (int64_t j = 0; j < begin; ++j) {
+			new_begin += context_rule_length(p_lsystem, segment, segment_len, j);
+		}
+		for (int64_t j = end; j < segment_len; ++j) {
+			right_len += context_rule_length(p_lsystem, segment, segment_len, j);
+		}
+		char *new_segment = expand_path(p_lsystem, segment);
+		int64_t new_len = strlen(new_segment);
+		int64_t new_end = new_len - right_len;
+		// Keep only the nearest n - i - 1 symbols of the halo. The outermost
+		// ones did not see their real neighbours, but they are always dropped.
+		int64_t keep = n - i - 1;
+		int64_t new_first = new_begin < keep ? 0 : new_begin - keep;
+		int64_t new_last = new_end + keep > new_len ? new_len : new_end + keep;
+		segment_len = new_last - new_first;
+		memmove(new_segment, new_segment + new_first, segment_len);
+		new_segment[segment_len] = '\0';
+		free(segment);
+		segment = new_segment;
+		begin = new_begin - new_first;
+		end = new_end - new_first;
 	}
+	if (p_len != NULL) *p_len = segment_len;
+	return segment;
+}
+
+int64_t expanded_length(lindenmayer_system *p_lsystem, char *path, int n)
+{
+	// lengths[c] is the length of the symbol c expanded for i times
+	int64_t lengths[256];
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	for (int i = 0; i < n; ++i) next_expanded_lengths(p_lsystem, lengths);
+	int64_t ans = 0;
+	for (int64_t i = 0; path[i] != '\0'; ++i) ans += lengths[(int)path[i]];
 	return ans;
 }
+
+// Return how many iterations the next pass of an expansion does when n are
+// left. The remainder of the highest power goes first, while the paths are
+// short, so that the last passes start from paths as short as possible.
+static int next_pass_power(lindenmayer_system *p_lsystem, int n)
+{
+	int power = n % p_lsystem->rule_power;
+	return power == 0 ? p_lsystem->rule_power : power;
+}
+
+// Compute the capacity each buffer of an arena needs to expand the path for n
+// times and the largest number of blocks one of the expansions is split in
+static void compute_arena_sizes(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int n, int64_t *capacity, int *p_max_blocks)
+{
+	// The expansion of the k-th pass is written in buffers[(k - 1) % 2], so
+	// each buffer only has to hold the longest of the expansions that end up
+	// in it
+	int64_t lengths[256];
+	capacity[0] = n <= 0 ? path_len : 0;
+	capacity[1] = 0;
+	*p_max_blocks = (path_len + EXPAND_BLOCK_SIZE - 1) / EXPAND_BLOCK_SIZE;
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	for (int i = 0, k = 1; i < n; ++k) {
+		int power = next_pass_power(p_lsystem, n - i);
+		for (int d = 0; d < power; ++d) next_expanded_lengths(p_lsystem, lengths);
+		i += power;
+		int64_t len = 0;
+		for (int64_t j = 0; j < path_len; ++j) len += lengths[(int)path[j]];
+		if (capacity[(k - 1) % 2] < len) capacity[(k - 1) % 2] = len;
+		int n_blocks = (len + EXPAND_BLOCK_SIZE - 1) / EXPAND_BLOCK_SIZE;
+		if (i < n && *p_max_blocks < n_blocks) *p_max_blocks = n_blocks;
+	}
+}
+
+void initialize_arena(lindenmayer_arena *p_arena, lindenmayer_system *p_lsystem,
+	char *path, int64_t path_len, int n)
+{
+	int max_blocks;
+	compute_arena_sizes(p_lsystem, path, path_len, n, p_arena->capacity, &max_blocks);
+	p_arena->file_backed = 0;
+	p_arena->buffers[0] = malloc((p_arena->capacity[0] + 1) * sizeof(char));
+	p_arena->buffers[1] = malloc((p_arena->capacity[1] + 1) * sizeof(char));
+	p_arena->block_offsets = malloc((max_blocks + 1) * sizeof(int64_t));
+}
+
+// Map a new temporary file of the given size from the given directory. The
+// file is unlinked right away so it goes away together with the mapping.
+static char *map_temporary_file(char *directory, int64_t size)
+{
+	char file_name[4096];
+	snprintf(file_name, sizeof(file_name), "%s/lindenmayer-XXXXXX", directory);
+	int fd = mkstemp(file_name);
+	if (fd < 0) return NULL;
+	unlink(file_name);
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return NULL;
+	}
+	char *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return buffer == MAP_FAILED ? NULL : buffer;
+}
+
+int initialize_file_backed_arena(lindenmayer_arena *p_arena,
+	lindenmayer_system *p_lsystem, char *path, int64_t path_len, int n,
+	char *directory)
+{
+	int max_blocks;
+	compute_arena_sizes(p_lsystem, path, path_len, n, p_arena->capacity, &max_blocks);
+	p_arena->file_backed = 1;
+	p_arena->buffers[0] = map_temporary_file(directory, p_arena->capacity[0] + 1);
+	p_arena->buffers[1] = map_temporary_file(directory, p_arena->capacity[1] + 1);
+	if (p_arena->buffers[0] == NULL || p_arena->buffers[1] == NULL) {
+		// Unmap the buffer that might have succeeded (preventing leaks)
+		fprintf(stderr, "ERROR: Could not map the expansion files in %s.\n", directory);
+		if (p_arena->buffers[0] != NULL) munmap(p_arena->buffers[0], p_arena->capacity[0] + 1);
+		if (p_arena->buffers[1] != NULL) munmap(p_arena->buffers[1], p_arena->capacity[1] + 1);
+		return LINDENMAYER_ERROR;
+	}
+	p_arena->block_offsets = malloc((max_blocks + 1) * sizeof(int64_t));
+	return LINDENMAYER_SUCCESS;
+}
+
+char *expand_in_arena(lindenmayer_system *p_lsystem, lindenmayer_arena *p_arena,
+	char *path, int64_t path_len, int n)
+{
+	if (n <= 0) {
+		memcpy(p_arena->buffers[0], path, path_len);
+		p_arena->buffers[0][path_len] = '\0';
+		return p_arena->buffers[0];
+	}
+	for (int i = 0, k = 1; i < n; ++k) {
+		char *new_path = p_arena->buffers[(k - 1) % 2];
+		int power = next_pass_power(p_lsystem, n - i);
+		int64_t new_len = compute_block_offsets(p_lsystem, path, path_len, power,
+		                                    p_arena->block_offsets);
+		scatter_blocks(p_lsystem, path, path_len, power, p_arena->block_offsets, new_path);
+		path = new_path;
+		path_len = new_len;
+		i += power;
+	}
+	return path;
+}
+
+void clear_arena(lindenmayer_arena *p_arena)
+{
+	if (p_arena->file_backed) {
+		munmap(p_arena->buffers[0], p_arena->capacity[0] + 1);
+		munmap(p_arena->buffers[1], p_arena->capacity[1] + 1);
+	} else {
+		free(p_arena->buffers[0]);
+		free(p_arena->buffers[1]);
+	}
+	free(p_arena->block_offsets);
+}
+
+// Write the symbol expanded for n times in out, copying it from the cache if
+// possible, and return its length
+static int64_t expand_symbol_with_cache(lindenmayer_system *p_lsystem,
+	lindenmayer_cache *p_cache, char c, int n, char *out)
+{
+	int id = p_lsystem->rule_id[(uint8_t)c];
+	if (id == 0 || n == 0) {
+		*out = c;
+		return 1;
+	}
+	if (n <= p_cache->depth) {
+		int index = (n - 1) * p_cache->n_rules + id;
+		memcpy(out, p_cache->blocks[index], p_cache->lengths[index]);
+		return p_cache->lengths[index];
+	}
+	char *rule = p_lsystem->rule_storage + p_lsystem->rule_offsets[id];
+	int64_t len = 0;
+	for (int k = 0; k < p_lsystem->rule_lengths[id]; ++k) {
+		len += expand_symbol_with_cache(p_lsystem, p_cache, rule[k], n - 1, out + len);
+	}
+	return len;
+}
+
+void initialize_lsystem_cache(lindenmayer_cache *p_cache,
+	lindenmayer_system *p_lsystem, int n)
+{
+	int64_t lengths[256];
+	int n_rules = p_lsystem->n_rules;
+	p_cache->blocks = malloc(n * n_rules * sizeof(char *));
+	p_cache->lengths = malloc(n * n_rules * sizeof(int64_t));
+	p_cache->n_rules = n_rules;
+	p_cache->depth = 0;
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	for (int d = 1; d <= n; ++d) {
+		next_expanded_lengths(p_lsystem, lengths);
+		int fits = 1;
+		for (int c = 0; c < 256; ++c) {
+			if (p_lsystem->rule_id[c] != 0 && lengths[c] > CACHE_BLOCK_SIZE) fits = 0;
+		}
+		if (!fits) break;
+		// Every block is made of the blocks of the previous depth
+		for (int c = 0; c < 256; ++c) {
+			int id = p_lsystem->rule_id[c];
+			if (id == 0) continue;
+			int index = (d - 1) * n_rules + id;
+			p_cache->lengths[index] = lengths[c];
+			p_cache->blocks[index] = malloc(lengths[c] * sizeof(char));
+			expand_symbol_with_cache(p_lsystem, p_cache, (char)c, d, p_cache->blocks[index]);
+		}
+		p_cache->depth = d;
+	}
+}
+
+int64_t expand_with_cache(lindenmayer_system *p_lsystem, lindenmayer_cache *p_cache,
+	char *path, int64_t path_len, int n, char *new_path)
+{
+	// Compute where the expansion of every symbol starts
+	int64_t lengths[256];
+	int64_t *offsets = malloc((path_len + 1) * sizeof(int64_t));
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	for (int i = 0; i < n; ++i) next_expanded_lengths(p_lsystem, lengths);
+	offsets[0] = 0;
+	for (int64_t i = 0; i < path_len; ++i) {
+		offsets[i + 1] = offsets[i] + lengths[(uint8_t)path[i]];
+	}
+
+	#pragma omp parallel for schedule(dynamic) if (path_len > 1)
+	for (int64_t i = 0; i < path_len; ++i) {
+		expand_symbol_with_cache(p_lsystem, p_cache, path[i], n, new_path + offsets[i]);
+	}
+	int64_t new_len = offsets[path_len];
+	new_path[new_len] = '\0';
+	free(offsets);
+	return new_len;
+}
+
+void clear_lsystem_cache(lindenmayer_cache *p_cache)
+{
+	for (int d = 1; d <= p_cache->depth; ++d) {
+		for (int id = 1; id < p_cache->n_rules; ++id) {
+			free(p_cache->blocks[(d - 1) * p_cache->n_rules + id]);
+		}
+	}
+	free(p_cache->blocks);
+	free(p_cache->lengths);
+}
+
+// Read the run starting at the given nibble of the packed path, moving the
+// nibble after it. Return its token (or -1 at the end) and store its length.
+static int read_packed_run(lindenmayer_packed_path *p_packed, int64_t *p_nibble,
+	int64_t *p_count)
+{
+	int64_t i = *p_nibble;
+	if (i >= p_packed->n_nibbles) return -1;
+	int token = (p_packed->data[i >> 1] >> ((i & 1) * 4)) & 15;
+	*p_count = 1;
+	++i;
+	if (i < p_packed->n_nibbles &&
+	    ((p_packed->data[i >> 1] >> ((i & 1) * 4)) & 15) == PACKED_RUN_TOKEN) {
+		int nibble, shift = 0;
+		*p_count = 0;
+		do {
+			++i;
+			nibble = (p_packed->data[i >> 1] >> ((i & 1) * 4)) & 15;
+			*p_count |= (int64_t)(nibble & 7) << shift;
+			shift += 3;
+		} while (nibble & 8);
+		++i;
+	}
+	*p_nibble = i;
+	return token;
+}
+
+static void write_nibble(lindenmayer_packed_path *p_packed, int nibble)
+{
+	int64_t i = p_packed->n_nibbles++;
+	if (i & 1) p_packed->data[i >> 1] |= nibble << 4;
+	else p_packed->data[i >> 1] = nibble;
+}
+
+// Append count times the given token to the packed path. Pending runs are
+// kept in run_token and run_count so they can be merged with the next ones
+// and are written once flush is set.
+static void write_packed_run(lindenmayer_packed_path *p_packed, int *p_run_token,
+	int64_t *p_run_count, int token, int64_t count, int flush)
+{
+	if (token == *p_run_token && !flush) {
+		*p_run_count += count;
+		return;
+	}
+	if (*p_run_count > 0 && (!p_packed->use_runs || *p_run_count < 4)) {
+		for (int64_t k = 0; k < *p_run_count; ++k) write_nibble(p_packed, *p_run_token);
+	} else if (*p_run_count > 0) {
+		write_nibble(p_packed, *p_run_token);
+		write_nibble(p_packed, PACKED_RUN_TOKEN);
+		for (int64_t left = *p_run_count; left > 0; left >>= 3) {
+			write_nibble(p_packed, (left & 7) | (left > 7 ? 8 : 0));
+		}
+	}
+	p_packed->length += *p_run_count;
+	*p_run_token = token;
+	*p_run_count = count;
+}
+
+// Make sure the packed path can hold the given number of symbols (a run never
+// takes more nibbles than its length) and empty it
+static void reset_packed_path(lindenmayer_packed_path *p_packed, int64_t length)
+{
+	int64_t capacity = length / 2 + 1;
+	if (p_packed->capacity < capacity) {
+		free(p_packed->data);
+		p_packed->data = malloc(capacity * sizeof(uint8_t));
+		p_packed->capacity = capacity;
+	}
+	p_packed->n_nibbles = 0;
+	p_packed->length = 0;
+}
+
+void initialize_lsystem_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, char *path, int n)
+{
+	initialize_derivation_stream(p_stream, p_lsystem, path, NULL, n);
+}
+
+void initialize_derivation_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, char *path, uint64_t *nodes, int n)
+{
+	p_stream->p_lsystem = p_lsystem;
+	p_stream->frames = malloc((n + 1) * sizeof(lindenmayer_frame));
+	p_stream->frames[0].rule = path;
+	p_stream->frames[0].position = 0;
+	p_stream->frames[0].node = p_lsystem->seed;
+	p_stream->nodes = nodes;
+	p_stream->depth = 0;
+	p_stream->n_iterations = n;
+	p_stream->n_left = INT64_MAX;
+	p_stream->p_packed = NULL;
+}
+
+void seek_lsystem_stream(lindenmayer_stream *p_stream, int64_t offset,
+	int64_t length)
+{
+	lindenmayer_system *p_lsystem = p_stream->p_lsystem;
+	int n = p_stream->n_iterations;
+	// lengths[i * 256 + c] is the length of the symbol c expanded for i times
+	int64_t *lengths = malloc((n + 1) * 256 * sizeof(int64_t));
+	for (int c = 0; c < 256; ++c) lengths[c] = 1;
+	for (int i = 1; i <= n; ++i) {
+		memcpy(lengths + i * 256, lengths + (i - 1) * 256, 256 * sizeof(int64_t));
+		next_expanded_lengths(p_lsystem, lengths + i * 256);
+	}
+	// Skip the whole symbols before the offset and enter the one containing it
+	while (offset > 0) {
+		lindenmayer_frame *p_frame = &p_stream->frames[p_stream->depth];
+		char c = p_frame->rule[p_frame->position];
+		if (c == '\0') break;
+		++p_frame->position;
+		int64_t len = lengths[(n - p_stream->depth) * 256 + (uint8_t)c];
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		p_frame = &p_stream->frames[++p_stream->depth];
+		p_frame->rule = p_lsystem->rules[(int)c];
+		p_frame->position = 0;
+	}
+	p_stream->n_left = length;
+	free(lengths);
+}
+
+void initialize_packed_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, lindenmayer_packed_path *p_packed, int n)
+{
+	initialize_lsystem_stream(p_stream, p_lsystem, NULL, n);
+	p_stream->p_packed = p_packed;
+	p_stream->nibble = 0;
+	p_stream->run_left = 0;
+}
+
+char next_symbol(lindenmayer_stream *p_stream)
+{
+	if (p_stream->n_left == 0) return '\0';
+	while (p_stream->depth >= 0) {
+		char c;
+		if (p_stream->depth == 0 && p_stream->p_packed != NULL) {
+			if (p_stream->run_left == 0) {
+				p_stream->run_token = read_packed_run(p_stream->p_packed,
+					&p_stream->nibble, &p_stream->run_left);
+				if (p_stream->run_token < 0) {
+					--p_stream->depth;
+					continue;
+				}
+			}
+			--p_stream->run_left;
+			c = p_stream->p_lsystem->token_symbol[p_stream->run_token];
+		} else {
+			lindenmayer_frame *p_frame = &p_stream->frames[p_stream->depth];
+			c = p_frame->rule[p_frame->position];
+			if (c == '\0') {
+				// This rule is done, continue with its parent
+				--p_stream->depth;
+				continue;
+			}
+			++p_frame->position;
+		}
+		char *rule = p_stream->p_lsystem->rules[(int)c];
+		if (p_stream->depth < p_stream->n_iterations && rule != NULL) {
+			// Descend into the production of this symbol
+			lindenmayer_frame *p_frame = &p_stream->frames[p_stream->depth];
+			uint64_t node = 0;
+			if (p_stream->p_lsystem->is_stochastic) {
+				if (p_stream->depth == 0 && p_stream->nodes != NULL) {
+					node = p_stream->nodes[p_frame->position - 1];
+				} else {
+					node = derivation_node(p_frame->node, p_frame->position - 1);
+				}
+				rule = choose_production(p_stream->p_lsystem, c, node);
+			}
+			p_frame = &p_stream->frames[++p_stream->depth];
+			p_frame->rule = rule;
+			p_frame->position = 0;
+			p_frame->node = node;
+			continue;
+		}
+		--p_stream->n_left;
+		return c;
+	}
+	return '\0';
+}
+
+void clear_lsystem_stream(lindenmayer_stream *p_stream)
+{
+	free(p_stream->frames);
+	p_stream->frames = NULL;
+}
+
+void initialize_turtle_op_stream(turtle_op_stream *p_ops,
+	lindenmayer_stream *p_stream)
+{
+	p_ops->p_stream = p_stream;
+	p_ops->next = next_symbol(p_stream);
+	p_ops->index = 0;
+}
+
+int next_turtle_op(turtle_op_stream *p_ops, turtle_op *p_op)
+{
+	uint8_t *is_forward = p_ops->p_stream->p_lsystem->is_forward;
+	p_op->branch = 0;
+	p_op->turn = 0;
+	p_op->forward = 0;
+	if (p_ops->next == '[' || p_ops->next == ']') {
+		p_op->branch = p_ops->next == '[' ? 1 : -1;
+		p_ops->next = next_symbol(p_ops->p_stream);
+		++p_ops->index;
+	}
+	// Gather the turns up to the next forward symbol or bracket
+	while (p_ops->next != '\0' && !is_forward[(int)p_ops->next] &&
+	       p_ops->next != '[' && p_ops->next != ']') {
+		if (p_ops->next == '+') ++p_op->turn;
+		else if (p_ops->next == '-') --p_op->turn;
+		p_ops->next = next_symbol(p_ops->p_stream);
+		++p_ops->index;
+	}
+	p_op->index = p_ops->index;
+	if (p_ops->next == '\0') return p_op->branch != 0;
+	while (p_ops->next != '\0' && is_forward[(int)p_ops->next]) {
+		++p_op->forward;
+		p_ops->next = next_symbol(p_ops->p_stream);
+		++p_ops->index;
+	}
+	return 1;
+}
+
+void initialize_turtle_stack(turtle_stack *p_stack)
+{
+	p_stack->states = NULL;
+	p_stack->size = 0;
+	p_stack->capacity = 0;
+}
+
+void copy_turtle_stack(turtle_stack *p_stack, turtle_stack *p_source)
+{
+	initialize_turtle_stack(p_stack);
+	if (p_source->size == 0) return;
+	p_stack->states = malloc(p_source->size * sizeof(turtle_state));
+	memcpy(p_stack->states, p_source->states, p_source->size * sizeof(turtle_state));
+	p_stack->size = p_stack->capacity = p_source->size;
+}
+
+void push_turtle_state(turtle_stack *p_stack, double x, double y, double angle)
+{
+	if (p_stack->size == p_stack->capacity) {
+		p_stack->capacity = p_stack->capacity == 0 ? 16 : 2 * p_stack->capacity;
+		p_stack->states = realloc(p_stack->states,
+		                          p_stack->capacity * sizeof(turtle_state));
+	}
+	turtle_state *p_state = &p_stack->states[p_stack->size++];
+	p_state->x = x;
+	p_state->y = y;
+	p_state->angle = angle;
+	memset(p_state->terms, 0, sizeof(p_state->terms));
+}
+
+int pop_turtle_state(turtle_stack *p_stack, double *p_x, double *p_y,
+	double *p_angle)
+{
+	if (p_stack->size == 0) return 0;
+	turtle_state *p_state = &p_stack->states[--p_stack->size];
+	*p_x = p_state->x;
+	*p_y = p_state->y;
+	*p_angle = p_state->angle;
+	return 1;
+}
+
+void push_turtle_heading(turtle_stack *p_stack, double x, double y, int64_t heading,
+	int64_t *terms)
+{
+	push_turtle_state(p_stack, x, y, 0);
+	turtle_state *p_state = &p_stack->states[p_stack->size - 1];
+	p_state->heading = heading;
+	memcpy(p_state->terms, terms, EXACT_MAX_TERMS * sizeof(int64_t));
+}
+
+int pop_turtle_heading(turtle_stack *p_stack, double *p_x, double *p_y,
+	int64_t *p_heading, int64_t *terms)
+{
+	double angle;
+	if (p_stack->size == 0) return 0;
+	turtle_state *p_state = &p_stack->states[p_stack->size - 1];
+	*p_heading = p_state->heading;
+	memcpy(terms, p_state->terms, EXACT_MAX_TERMS * sizeof(int64_t));
+	return pop_turtle_state(p_stack, p_x, p_y, &angle);
+}
+
+void transform_turtle_stack(turtle_stack *p_stack, double offset_x,
+	double offset_y, double scale)
+{
+	for (int i = 0; i < p_stack->size; ++i) {
+		p_stack->states[i].x = (p_stack->states[i].x + offset_x) * scale;
+		p_stack->states[i].y = (p_stack->states[i].y + offset_y) * scale;
+		for (int k = 0; k < EXACT_MAX_TERMS; ++k) p_stack->states[i].terms[k] *= (int64_t)scale;
+	}
+}
+
+void clear_turtle_stack(turtle_stack *p_stack)
+{
+	free(p_stack->states);
+	initialize_turtle_stack(p_stack);
+}
+
+// Compute the position of the turtle on the pixmap from its fixed point
+static void locate_turtle(turtle *p_turtle)
+{
+	// The fractions keep their top 53 bits, which a double holds exactly
+	p_turtle->x = p_turtle->origin_x + p_turtle->fixed_x.whole +
+	              (int64_t)(p_turtle->fixed_x.fraction >> 11) * 0x1p-53;
+	p_turtle->y = p_turtle->origin_y + p_turtle->fixed_y.whole +
+	              (int64_t)(p_turtle->fixed_y.fraction >> 11) * 0x1p-53;
+}
+
+// Add the step of the heading to a fixed point coordinate
+static void add_fixed_step(fixed_point *p_sum, fixed_point *p_step)
+{
+	p_sum->fraction += p_step->fraction;
+	p_sum->whole += p_step->whole + (p_sum->fraction < p_step->fraction);
+}
+
+// Compute the fixed point of the exact terms of the turtle and its position
+static void anchor_turtle(turtle *p_turtle)
+{
+	lindenmayer_system *p_lsystem = p_turtle->p_lsystem;
+	memset(p_turtle->steps, 0, p_lsystem->n_headings * sizeof(int64_t));
+	memset(&p_turtle->fixed_x, 0, sizeof(fixed_point));
+	memset(&p_turtle->fixed_y, 0, sizeof(fixed_point));
+	// The first n_terms headings are the unit vectors of the terms
+	for (int k = 0; k < p_lsystem->n_terms; ++k) {
+		add_fixed_multiple(&p_turtle->fixed_x, p_turtle->terms[k], p_lsystem->heading_fixed[2 * k]);
+		add_fixed_multiple(&p_turtle->fixed_y, p_turtle->terms[k],
+		                   p_lsystem->heading_fixed[2 * k + 1]);
+	}
+	locate_turtle(p_turtle);
+}
+
+// Add the steps counted along every heading to the exact terms of the turtle
+static void settle_turtle(turtle *p_turtle)
+{
+	lindenmayer_system *p_lsystem = p_turtle->p_lsystem;
+	int n_terms = p_lsystem->n_terms;
+	for (int h = 0; h < p_lsystem->n_headings; ++h) {
+		if (p_turtle->steps[h] == 0) continue;
+		int64_t *row = &p_lsystem->heading_terms[h * n_terms];
+		for (int k = 0; k < n_terms; ++k) p_turtle->terms[k] += p_turtle->steps[h] * row[k];
+		p_turtle->steps[h] = 0;
+	}
+}
+
+void place_turtle(turtle *p_turtle, lindenmayer_system *p_lsystem, double origin_x,
+	double origin_y, int scale, double x, double y, int64_t *terms, int64_t heading)
+{
+	p_turtle->p_lsystem = p_lsystem;
+	p_turtle->origin_x = origin_x;
+	p_turtle->origin_y = origin_y;
+	p_turtle->x = origin_x + x * scale;
+	p_turtle->y = origin_y + y * scale;
+	for (int k = 0; k < EXACT_MAX_TERMS; ++k) p_turtle->terms[k] = terms[k] * scale;
+	p_turtle->heading = 0;
+	turn_turtle(p_turtle, heading);
+	if (p_lsystem->n_terms > 0) anchor_turtle(p_turtle);
+}
+
+void turn_turtle(turtle *p_turtle, int64_t turn)
+{
+	lindenmayer_system *p_lsystem = p_turtle->p_lsystem;
+	p_turtle->heading += turn;
+	if (p_lsystem->n_terms == 0) {
+		heading_vector(p_lsystem, p_turtle->heading, &p_turtle->dx, &p_turtle->dy);
+		return;
+	}
+	int h = p_turtle->heading % p_lsystem->n_headings;
+	if (h < 0) h += p_lsystem->n_headings;
+	p_turtle->step_heading = h;
+	p_turtle->step_fixed = &p_lsystem->heading_fixed[2 * h];
+}
+
+void step_turtle(turtle *p_turtle)
+{
+	if (p_turtle->p_lsystem->n_terms == 0) {
+		p_turtle->x += p_turtle->dx;
+		p_turtle->y += p_turtle->dy;
+		return;
+	}
+	++p_turtle->steps[p_turtle->step_heading];
+	add_fixed_step(&p_turtle->fixed_x, &p_turtle->step_fixed[0]);
+	add_fixed_step(&p_turtle->fixed_y, &p_turtle->step_fixed[1]);
+	locate_turtle(p_turtle);
+}
+
+void push_turtle(turtle_stack *p_stack, turtle *p_turtle)
+{
+	if (p_turtle->p_lsystem->n_terms > 0) settle_turtle(p_turtle);
+	push_turtle_heading(p_stack, p_turtle->x, p_turtle->y, p_turtle->heading,
+	                    p_turtle->terms);
+}
+
+int pop_turtle(turtle_stack *p_stack, turtle *p_turtle)
+{
+	if (!pop_turtle_heading(p_stack, &p_turtle->x, &p_turtle->y, &p_turtle->heading,
+	                        p_turtle->terms)) return 0;
+	turn_turtle(p_turtle, 0);
+	if (p_turtle->p_lsystem->n_terms > 0) anchor_turtle(p_turtle);
+	return 1;
+}
+
+int pack_path(lindenmayer_system *p_lsystem, char *path, int64_t path_len,
+	int use_runs, lindenmayer_packed_path *p_packed)
+{
+	int run_token = -1;
+	int64_t run_count = 0;
+	p_packed->data = NULL;
+	p_packed->capacity = 0;
+	p_packed->use_runs = use_runs;
+	reset_packed_path(p_packed, path_len);
+	for (int64_t i = 0; i < path_len; ++i) {
+		int token = p_lsystem->token[(uint8_t)path[i]];
+		if (token == PACKED_RUN_TOKEN) {
+			clear_packed_path(p_packed);
+			return LINDENMAYER_ERROR;
+		}
+		write_packed_run(p_packed, &run_token, &run_count, token, 1, 0);
+	}
+	write_packed_run(p_packed, &run_token, &run_count, -1, 0, 1);
+	return LINDENMAYER_SUCCESS;
+}
+
+void expand_packed_path(lindenmayer_system *p_lsystem,
+	lindenmayer_packed_path *p_path, lindenmayer_packed_path *p_new_path)
+{
+	int token, run_token = -1;
+	int64_t nibble, count, run_count = 0;
+
+	// Size the new path
+	int64_t new_length = 0;
+	for (nibble = 0; (token = read_packed_run(p_path, &nibble, &count)) >= 0; ) {
+		new_length += count * p_lsystem->rule_lengths[
+			p_lsystem->rule_id[(uint8_t)p_lsystem->token_symbol[token]]];
+	}
+	reset_packed_path(p_new_path, new_length);
+	p_new_path->use_runs = p_path->use_runs;
+
+	// Find the rules that are a run of a single symbol
+	uint8_t is_run[256];
+	for (int id = 1; id < p_lsystem->n_rules; ++id) {
+		char *rule = p_lsystem->rule_storage + p_lsystem->rule_offsets[id];
+		is_run[id] = 1;
+		for (int k = 1; k < p_lsystem->rule_lengths[id]; ++k) {
+			if (rule[k] != rule[0]) is_run[id] = 0;
+		}
+	}
+
+	for (nibble = 0; (token = read_packed_run(p_path, &nibble, &count)) >= 0; ) {
+		int id = p_lsystem->rule_id[(uint8_t)p_lsystem->token_symbol[token]];
+		char *rule = p_lsystem->rule_storage + p_lsystem->rule_offsets[id];
+		int rule_len = p_lsystem->rule_lengths[id];
+		if (id == 0) {
+			write_packed_run(p_new_path, &run_token, &run_count, token, count, 0);
+		} else if (is_run[id]) {
+			write_packed_run(p_new_path, &run_token, &run_count,
+			                 p_lsystem->token[(uint8_t)rule[0]], count * rule_len, 0);
+		} else {
+			for (int64_t j = 0; j < count; ++j) {
+				for (int k = 0; k < rule_len; ++k) {
+					write_packed_run(p_new_path, &run_token, &run_count,
+					                 p_lsystem->token[(uint8_t)rule[k]], 1, 0);
+				}
+			}
+		}
+	}
+	write_packed_run(p_new_path, &run_token, &run_count, -1, 0, 1);
+}
+
+int expand_packed_lsystem(lindenmayer_system *p_lsystem, int n, int use_runs,
+	lindenmayer_packed_path *p_packed)
+{
+	lindenmayer_packed_path other;
+	if (pack_path(p_lsystem, p_lsystem->start, strlen(p_lsystem->start),
+	              use_runs, p_packed) != LINDENMAYER_SUCCESS) {
+		fprintf(stderr, "ERROR: Lindenmayer system has too many symbols to pack.\n");
+		return LINDENMAYER_ERROR;
+	}
+	// Alternate between the two paths, reusing their buffers
+	other.data = NULL;
+	other.capacity = 0;
+	for (int i = 0; i < n; ++i) {
+		lindenmayer_packed_path tmp;
+		expand_packed_path(p_lsystem, p_packed, &other);
+		tmp = *p_packed;
+		*p_packed = other;
+		other = tmp;
+	}
+	clear_packed_path(&other);
+	return LINDENMAYER_SUCCESS;
+}
+
+void clear_packed_path(lindenmayer_packed_path *p_packed)
+{
+	free(p_packed->data);
+	p_packed->data = NULL;
+	p_packed->capacity = 0;
+}
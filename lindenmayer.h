@@ -3,13 +3,177 @@
 
 #include <stdint.h>
 
+#define LINDENMAYER_ERROR -1
+#define LINDENMAYER_SUCCESS 0
+
+// Tokens of packed paths are nibbles and the last one marks a run
+#define PACKED_MAX_TOKENS 15
+#define PACKED_RUN_TOKEN 15
+
+// Most terms of the exact position of a turtle (see compile_lsystem)
+#define EXACT_MAX_TERMS 8
+
+// Most headings of a system with exact terms: any more headings need more
+// than EXACT_MAX_TERMS terms
+#define EXACT_MAX_HEADINGS 30
+
+// Most directions in which the extents of a drawing are kept, and the number
+// of them used when the headings do not fit (see compile_lsystem)
+#define MAX_BOUND_DIRECTIONS 64
+#define BOUND_DIRECTIONS 16
+
+// A coordinate in pixels with a 64-bit fraction, whose sums are exact
+typedef struct {
+	int64_t whole; // rounded down
+	uint64_t fraction; // in 2^-64 pixels
+} fixed_point;
+
 typedef struct {
 	char *rules[256];
 	char *start;
 	uint8_t is_forward[256];
 	double angle;
+	// Compiled form of the rules (see compile_lsystem). Rule 0 stands for the
+	// symbols without a rule, which are copied as they are. The entries
+	// (d - 1) * n_rules + id of rule_lengths and rule_offsets are the ones of
+	// the rule expanded for d times, for every d up to rule_power.
+	uint8_t rule_id[256];
+	int n_rules, rule_power;
+	int *rule_lengths;
+	int *rule_offsets;
+	char *rule_storage;
+	// Every symbol that can appear in a path gets a small token id (used by
+	// packed paths). n_tokens is 0 if there are too many symbols to pack.
+	uint8_t token[256];
+	char token_symbol[PACKED_MAX_TOKENS];
+	int n_tokens;
+	// Stochastic systems have several weighted productions for a symbol and
+	// choose one of them for every occurrence (see choose_production). The
+	// first one is also kept in rules. Only expand_lsystem and the streams
+	// started from the start or from expand_lsystem_with_nodes choose, the
+	// other expansions, lengths and seeks always use rules.
+	int is_stochastic;
+	uint64_t seed;
+	int n_productions[256];
+	char **productions[256];
+	int *weights[256]; // cumulative weights of the productions
+	// Context sensitive systems have productions that replace the rule of a
+	// symbol when its neighbours in the path match (see choose_context_rule).
+	// Only expand_path, expand_lsystem and expand_with_halo look at the
+	// neighbours, the other expansions, lengths and seeks always use rules.
+	int is_context_sensitive;
+	int n_context_rules[256];
+	char *left_contexts[256]; // '\0' if any left neighbour matches
+	char *right_contexts[256]; // '\0' if any right neighbour matches
+	char **context_rules[256];
+	// The turtle faces heading h after turning by h times the angle. When the
+	// angle divides the full turn, the unit vectors of its n_headings headings
+	// are stored (see compile_lsystem), otherwise n_headings is 0.
+	int n_headings;
+	double *heading_x, *heading_y;
+	// Positions are kept exact as whole combinations of the unit vectors of
+	// the first n_terms headings, in which the one of heading h has the terms
+	// heading_terms[h * n_terms], ... (see compile_lsystem). n_terms is 0 if
+	// the headings are not tabulated or need more than EXACT_MAX_TERMS terms.
+	int n_terms;
+	int64_t *heading_terms;
+	// The steps of the headings in fixed point, heading_fixed[2 * h] along x
+	// and heading_fixed[2 * h + 1] along y, found from their terms so that
+	// adding them up gives the fixed point of the terms whatever the order.
+	fixed_point *heading_fixed;
+	// The drawings are bounded by their extents in n_directions evenly spaced
+	// directions, starting with the x axis, whose unit vectors are stored.
+	// Turning by a heading shifts them by direction_shift directions, or by a
+	// fraction of a direction if direction_shift is 0.
+	int n_directions, direction_shift;
+	double *direction_x, *direction_y;
 } lindenmayer_system;
 
+typedef struct {
+	uint8_t *data; // two tokens per byte, the first one in the low nibble
+	int64_t n_nibbles, capacity;
+	int64_t length; // number of symbols of the unpacked path
+	int use_runs;
+} lindenmayer_packed_path;
+
+typedef struct {
+	char *rule;
+	int64_t position;
+	uint64_t node; // derivation node of the symbol the rule was chosen for
+} lindenmayer_frame;
+
+typedef struct {
+	lindenmayer_system *p_lsystem;
+	lindenmayer_frame *frames;
+	int depth, n_iterations;
+	int64_t n_left; // number of symbols the stream may still yield
+	uint64_t *nodes; // derivation nodes of the symbols of the path, if given
+	// Set when the path being expanded is packed
+	lindenmayer_packed_path *p_packed;
+	int run_token;
+	int64_t nibble, run_left;
+} lindenmayer_stream;
+
+typedef struct {
+	int branch; // 1 to save the turtle state and -1 to restore it, done first
+	int turn; // heading change in multiples of the angle, done before moving
+	int64_t forward; // number of consecutive forward symbols to move by
+	int64_t index; // index in the path of the first forward symbol
+} turtle_op;
+
+typedef struct {
+	lindenmayer_stream *p_stream;
+	char next; // symbol read ahead from the stream
+	int64_t index; // index of the symbol read ahead
+} turtle_op_stream;
+
+typedef struct {
+	double x, y, angle;
+	int64_t heading; // used instead of the angle by push_turtle_heading
+	int64_t terms[EXACT_MAX_TERMS]; // exact position, for push_turtle_heading
+} turtle_state;
+
+typedef struct {
+	turtle_state *states;
+	int size, capacity;
+} turtle_stack;
+
+/**
+ *    A turtle drawing on a pixmap, which is (x, y). When the system has exact
+ * terms, the position is kept as a whole number of pixels along the unit
+ * vector of each of the first headings, and alongside in fixed point, which is
+ * only turned into (x, y) at every pixel, so it never drifts and is the same
+ * however the walk was split. The steps are only counted by heading, and
+ * added to the terms when the turtle is pushed.
+ */
+typedef struct {
+	lindenmayer_system *p_lsystem;
+	double x, y;
+	int64_t heading;
+	int64_t terms[EXACT_MAX_TERMS]; // exact position before the steps below
+	int64_t steps[EXACT_MAX_HEADINGS]; // steps along each heading since then
+	double origin_x, origin_y; // pixel of the position without terms
+	double dx, dy; // step of the heading, used without exact terms
+	int step_heading; // heading modulo n_headings, whose steps are counted
+	fixed_point fixed_x, fixed_y; // fixed point of the exact position
+	fixed_point *step_fixed; // fixed point of the step of the heading
+} turtle;
+
+typedef struct {
+	// blocks[(d - 1) * n_rules + id] is the rule with the given id expanded
+	// for d times, for every d up to depth
+	char **blocks;
+	int64_t *lengths;
+	int depth, n_rules;
+} lindenmayer_cache;
+
+typedef struct {
+	char *buffers[2];
+	int64_t capacity[2];
+	int64_t *block_offsets;
+	int file_backed;
+} lindenmayer_arena;
+
 void initialize_dragon_curve(lindenmayer_system *p_lsystem);
 
 void initialize_koch_curve(lindenmayer_system *p_lsystem);
@@ -22,6 +186,91 @@ void initialize_levy_curve(lindenmayer_system *p_lsystem);
 
 void initialize_pentaplexity(lindenmayer_system *p_lsystem);
 
+void initialize_fractal_plant(lindenmayer_system *p_lsystem);
+
+void initialize_stochastic_plant(lindenmayer_system *p_lsystem);
+
+void initialize_context_koch_curve(lindenmayer_system *p_lsystem);
+
+/**
+ *    Add a production for the given symbol, which will be chosen with a
+ * probability proportional to its weight among the productions of the symbol.
+ * The system becomes stochastic once a symbol has more than one production.
+ * compile_lsystem must be called after all the productions are added.
+ */
+void add_production(lindenmayer_system *p_lsystem, char c, char *rule, int weight);
+
+/**
+ *    Return the derivation node of the symbol at the given position of the
+ * production chosen for the given node. The symbols of the start are the
+ * children of the seed, so every node is a hash of the seed and of the path to
+ * the symbol in the derivation tree.
+ */
+uint64_t derivation_node(uint64_t parent, int64_t position);
+
+/**
+ *    Return the production of the given symbol to use at the given derivation
+ * node, or NULL if the symbol has none. The choice is a hash of the node, so
+ * it is the same however and in whatever order the derivation is walked.
+ */
+char *choose_production(lindenmayer_system *p_lsystem, char c, uint64_t node);
+
+/**
+ *    Add a production that replaces the given symbol by the given rule when
+ * the symbol before it in the path is left and the one after it is right
+ * (a '\0' context matches any neighbour, including none at the ends of the
+ * path). The productions of a symbol are tried in the order they were added
+ * and its rule, which can be NULL, is used if none of them matches. The rules
+ * of a context sensitive system must not be empty and it can not be
+ * stochastic.
+ */
+void add_context_production(lindenmayer_system *p_lsystem, char left, char c,
+	char right, char *rule);
+
+/**
+ *    Return the rule to replace the i-th symbol of the given path (of path_len
+ * symbols) with, or NULL if the symbol is copied as it is.
+ */
+char *choose_context_rule(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int64_t i);
+
+/**
+ *    Build the compiled form of the rules: a dense symbol to rule id table,
+ * the length of every rule, all the rules stored one after the other, the
+ * table of the headings with their exact terms, the directions the drawings
+ * are bounded in and the token ids used by packed paths. The rules are also
+ * stored expanded for 2, 3, ... times, as long as all these powers fit in a
+ * small budget, so that an expansion can do several iterations in a single
+ * pass (except for context sensitive systems). The initialize functions
+ * already do this, but it must be called again whenever the rules are changed.
+ */
+void compile_lsystem(lindenmayer_system *p_lsystem);
+
+/**
+ *    Remove from the start and from the productions the dead symbols, which
+ * never expand to a symbol that moves, turns or branches the turtle, and
+ * compile the system again. They would only make the expanded paths longer:
+ * the drawing stays the same, except for the colors that follow the position
+ * in the path. Context sensitive systems are left as they are, as removing a
+ * symbol would change the neighbours of the others.
+ */
+void eliminate_dead_symbols(lindenmayer_system *p_lsystem);
+
+/**
+ *    Store in *p_x and *p_y the unit vector the turtle moves by when it faces
+ * the given heading, a number of turns by the angle of the system. It is read
+ * from the table of the headings if there is one.
+ */
+void heading_vector(lindenmayer_system *p_lsystem, int64_t heading, double *p_x,
+	double *p_y);
+
+/**
+ *    Add to terms the exact position given by turned_terms turned by the given
+ * heading. The system must have exact terms.
+ */
+void add_turned_terms(lindenmayer_system *p_lsystem, int64_t *terms,
+	int64_t *turned_terms, int64_t heading);
+
 /**
  *    Deallocate the memory used by the given lindenmayer system. The result
  * might be undefined so it should no longer be used without initializing it
@@ -33,11 +282,276 @@ void clear_lsystem(lindenmayer_system *p_lsystem);
  *    Expand the given path using the given lindenmayer system. The returned
  * string will be allocated and should be deallocated by the user of this
  * function. The initial path will not be changed.
+ *    When compiled with OpenMP, the path is split in blocks whose expanded
+ * sizes are computed and prefix summed, after which all blocks are written
+ * to the new path concurrently. The symbols of context sensitive systems read
+ * their neighbours from the old path, even across blocks.
  */
 char *expand_path(lindenmayer_system *p_lsystem, char *path);
 
 /**
- *    Expand the given lindemayer system for n times.
+ *    Expand the given lindemayer system for n times. The returned string will
+ * be allocated and should be deallocated by the user of this function.
  */
 char *expand_lsystem(lindenmayer_system *p_lsystem, int n);
+
+/**
+ *    Same as expand_lsystem, but for stochastic systems also set *p_nodes to
+ * an allocated array with the derivation node of every symbol of the returned
+ * path, which must be deallocated by the user of this function. *p_nodes is
+ * set to NULL for other systems. Stochastic systems are expanded sequentially
+ * and are meant to be expanded only a few times here, the rest of their
+ * derivation being walked by streams.
+ */
+char *expand_lsystem_with_nodes(lindenmayer_system *p_lsystem, int n,
+	uint64_t **p_nodes);
+
+/**
+ *    Compute the length that the given path would have after being expanded
+ * for n times, without expanding it.
+ */
+int64_t expanded_length(lindenmayer_system *p_lsystem, char *path, int n);
+
+/**
+ *    Expand the symbols from begin to end of the given path (of path_len
+ * symbols) for n times, for a context sensitive system. The symbols up to n
+ * places around them are expanded as well as their halo, so they see the
+ * right neighbours, but after every expansion only the part of the halo that
+ * can still change how they expand is kept. The returned string will be
+ * allocated and should be deallocated by the user of this function. Its
+ * length is stored in *p_len if p_len is not NULL.
+ */
+char *expand_with_halo(lindenmayer_system *p_lsystem, char *path, int64_t path_len,
+	int64_t begin, int64_t end, int n, int64_t *p_len);
+
+/**
+ *    Allocate an arena in which the first path_len symbols of the given path
+ * can be expanded for n times. It holds two buffers that the expansions
+ * alternate between, each sized for the longest expansion written in it, so
+ * expanding in the arena does not allocate any memory.
+ */
+void initialize_arena(lindenmayer_arena *p_arena, lindenmayer_system *p_lsystem,
+	char *path, int64_t path_len, int n);
+
+/**
+ *    Same as initialize_arena, but the buffers are memory mapped temporary
+ * files created in the given directory. This way the kernel can write the
+ * expansions that do not fit in memory out to disk.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR otherwise
+ */
+int initialize_file_backed_arena(lindenmayer_arena *p_arena,
+	lindenmayer_system *p_lsystem, char *path, int64_t path_len, int n,
+	char *directory);
+
+/**
+ *    Expand the first path_len symbols of the given path for n times using the
+ * buffers of an arena initialized for them (the path itself is not changed
+ * and needs not be terminated). Every pass uses the highest power of the
+ * rules that is compiled, so only about n / rule_power paths are written. The
+ * returned string is one of the buffers of the arena, so it is valid until
+ * the arena is used again or cleared.
+ */
+char *expand_in_arena(lindenmayer_system *p_lsystem, lindenmayer_arena *p_arena,
+	char *path, int64_t path_len, int n);
+
+/**
+ *    Deallocate the memory used by the given arena.
+ */
+void clear_arena(lindenmayer_arena *p_arena);
+
+/**
+ *    Initialize a cache holding the expansion of every rule for 1, 2, ... times,
+ * up to n times or until one of them would get longer than CACHE_BLOCK_SIZE.
+ */
+void initialize_lsystem_cache(lindenmayer_cache *p_cache,
+	lindenmayer_system *p_lsystem, int n);
+
+/**
+ *    Expand the first path_len symbols of the given path for n times into
+ * new_path, which must be able to hold expanded_length symbols and the string
+ * terminator. The expansion is done top-down, copying the cached expansion of
+ * a symbol as soon as few enough iterations are left, so the intermediate
+ * paths are never built.
+ *    @return the length of the expanded path
+ */
+int64_t expand_with_cache(lindenmayer_system *p_lsystem, lindenmayer_cache *p_cache,
+	char *path, int64_t path_len, int n, char *new_path);
+
+/**
+ *    Deallocate the memory used by the given cache.
+ */
+void clear_lsystem_cache(lindenmayer_cache *p_cache);
+
+/**
+ *    Initialize a stream that yields the symbols of the given path expanded for
+ * n times, one at a time. The derivation tree is walked depth-first using a
+ * stack of n + 1 frames so the expanded path is never built in memory. The
+ * given path must not be changed or freed while the stream is used.
+ */
+void initialize_lsystem_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, char *path, int n);
+
+/**
+ *    Same as initialize_lsystem_stream, but the symbols of the path have the
+ * given derivation nodes (see expand_lsystem_with_nodes). nodes can be NULL
+ * if the path is the start of the system or the system is not stochastic.
+ * Any part of a stochastic derivation can be walked this way without
+ * walking what comes before it.
+ */
+void initialize_derivation_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, char *path, uint64_t *nodes, int n);
+
+/**
+ *    Return the next symbol of the expansion or '\0' if there are none left.
+ */
+char next_symbol(lindenmayer_stream *p_stream);
+
+/**
+ *    Move the stream, which must not be packed or read from yet, to the symbol
+ * at the given offset of the expansion and let it yield at most length
+ * symbols from there. Only the productions on the way to that symbol are
+ * entered, so this takes O(n * rule length) steps.
+ */
+void seek_lsystem_stream(lindenmayer_stream *p_stream, int64_t offset,
+	int64_t length);
+
+/**
+ *    Initialize a stream that yields the symbols of the given packed path
+ * expanded for n times, decoding it on the fly.
+ */
+void initialize_packed_stream(lindenmayer_stream *p_stream,
+	lindenmayer_system *p_lsystem, lindenmayer_packed_path *p_packed, int n);
+
+/**
+ *    Deallocate the memory used by the given stream.
+ */
+void clear_lsystem_stream(lindenmayer_stream *p_stream);
+
+/**
+ *    Initialize a stream of turtle operations read from the symbols of the
+ * given stream.
+ */
+void initialize_turtle_op_stream(turtle_op_stream *p_ops,
+	lindenmayer_stream *p_stream);
+
+/**
+ *    Read the next turtle operation: a '[' or ']' symbol, the heading change of
+ * the '+' and '-' symbols after it and the run of forward symbols after them.
+ * The operation ends early, without moving, at the next bracket. Symbols
+ * which do not move or turn the turtle are dropped, but they still count for
+ * the index of the following symbols.
+ *    @return 1 if an operation was read or 0 if no symbols that move the
+ * turtle are left
+ */
+int next_turtle_op(turtle_op_stream *p_ops, turtle_op *p_op);
+
+/**
+ *    Initialize an empty stack of turtle states, used to return from the
+ * branches of bracketed lindenmayer systems.
+ */
+void initialize_turtle_stack(turtle_stack *p_stack);
+
+/**
+ *    Initialize the given stack as a copy of the source stack.
+ */
+void copy_turtle_stack(turtle_stack *p_stack, turtle_stack *p_source);
+
+/**
+ *    Save the given turtle state on top of the stack.
+ */
+void push_turtle_state(turtle_stack *p_stack, double x, double y, double angle);
+
+/**
+ *    Restore the turtle state on top of the stack and remove it.
+ *    @return 1 if successful or 0 if the stack is empty, in which case the
+ * turtle state is left unchanged
+ */
+int pop_turtle_state(turtle_stack *p_stack, double *p_x, double *p_y,
+	double *p_angle);
+
+/**
+ *    Same as push_turtle_state and pop_turtle_state for a turtle whose heading
+ * is a number of turns by the angle of the system, together with its exact
+ * position (EXACT_MAX_TERMS terms).
+ */
+void push_turtle_heading(turtle_stack *p_stack, double x, double y, int64_t heading,
+	int64_t *terms);
+
+int pop_turtle_heading(turtle_stack *p_stack, double *p_x, double *p_y,
+	int64_t *p_heading, int64_t *terms);
+
+/**
+ *    Move every state of the stack by the given offset and then scale it, the
+ * same way the start of a drawing is placed on the pixmap. The exact positions
+ * are scaled as well, so the scale must be whole.
+ */
+void transform_turtle_stack(turtle_stack *p_stack, double offset_x,
+	double offset_y, double scale);
+
+/**
+ *    Deallocate the memory used by the given stack.
+ */
+void clear_turtle_stack(turtle_stack *p_stack);
+
+/**
+ *    Place the turtle on a drawing whose steps are scale pixels long and which
+ * starts at (origin_x, origin_y) on the pixmap. The turtle is at (x, y), or at
+ * the given exact position (EXACT_MAX_TERMS terms) if the system has exact
+ * terms, in steps from the start, facing the given heading.
+ */
+void place_turtle(turtle *p_turtle, lindenmayer_system *p_lsystem, double origin_x,
+	double origin_y, int scale, double x, double y, int64_t *terms, int64_t heading);
+
+/**
+ *    Turn the turtle by the given number of turns by the angle of the system.
+ */
+void turn_turtle(turtle *p_turtle, int64_t turn);
+
+/**
+ *    Move the turtle by one pixel along its heading.
+ */
+void step_turtle(turtle *p_turtle);
+
+/**
+ *    Save the state of the turtle on top of the stack, which must have been
+ * transformed to the pixmap like the turtle, or restore it and remove it.
+ *    @return 1 if successful or 0 if the stack is empty, in which case the
+ * turtle is left unchanged
+ */
+void push_turtle(turtle_stack *p_stack, turtle *p_turtle);
+
+int pop_turtle(turtle_stack *p_stack, turtle *p_turtle);
+
+/**
+ *    Pack the first path_len symbols of the given path: every symbol is
+ * replaced by its token and two tokens are stored in a byte. If use_runs is
+ * set, runs of the same symbol are stored as the token, PACKED_RUN_TOKEN and
+ * the length of the run (3 bits per nibble, the 4th one set while more
+ * nibbles follow).
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR if the
+ * lindenmayer system has too many symbols or the path has unknown ones
+ */
+int pack_path(lindenmayer_system *p_lsystem, char *path, int64_t path_len,
+	int use_runs, lindenmayer_packed_path *p_packed);
+
+/**
+ *    Expand the given packed path into new_path without unpacking it. Runs of
+ * a symbol whose rule is a run itself (like G -> GG) stay a single run. The
+ * new path must be initialized (its buffer is reused when large enough).
+ */
+void expand_packed_path(lindenmayer_system *p_lsystem,
+	lindenmayer_packed_path *p_path, lindenmayer_packed_path *p_new_path);
+
+/**
+ *    Expand the given lindenmayer system for n times as a packed path.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR if the
+ * lindenmayer system has too many symbols to be packed
+ */
+int expand_packed_lsystem(lindenmayer_system *p_lsystem, int n, int use_runs,
+	lindenmayer_packed_path *p_packed);
+
+/**
+ *    Deallocate the memory used by the given packed path.
+ */
+void clear_packed_path(lindenmayer_packed_path *p_packed);
 #endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,41 +6,275 @@
 
 #include "lindenmayer.h"
 #include "lindenmayer_dp.h"
+#include "lindenmayer_file.h"
+#include "lindenmayer_param.h"
 #include "pixmap.h"
 
 // Decomment to not write the image
 // #define DONT_WRITE_IMAGE
 
-void draw_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, char *path,
-               double start_x, double start_y, double start_angle, int scale,
-               coloring_f coloring_f)
+// Decomment to draw the image right into this file instead of writing it
+// #define IMAGE_FILE "lindenmayer.ppm"
+
+// Decomment to keep the pixels of the image in tiles, which is faster to
+// draw on when the image is large
+// #define TILED_IMAGE
+
+// Decomment to walk the expansion lazily instead of building the whole path
+// #define STREAM_EXPANSION
+
+// Decomment to build the whole path packed (two symbols per byte and runs)
+// #define PACKED_EXPANSION
+
+// Decomment to build the whole path in memory mapped files in this directory
+// #define FILE_BACKED_EXPANSION "/tmp"
+
+// Decomment to build the whole path from cached expansions of the rules
+// #define CACHED_EXPANSION
+
+// Decomment to keep the whole path in expansion files in this directory and
+// map them in later runs instead of expanding again. The files are named
+// after the hash of the system and the number of iterations.
+// #define EXPANSION_FILE_DIRECTORY "/tmp"
+
+// Decomment to draw the productions smaller than a pixel of the viewport as a
+// single point instead of walking them
+// #define LEVEL_OF_DETAIL
+
+// Size in pixels under which the productions are drawn as one point even if
+// they cross pixels, which bounds the time by the size of the image
+#define LEVEL_OF_DETAIL_SIZE 0.25
+
+void draw_path(pixmap_t *p_pixmap, lindenmayer_stream *p_stream, turtle_stack *p_stack,
+               int64_t path_len, turtle *p_turtle, int scale, coloring_f coloring_f)
+{
+	color_point(p_pixmap, p_turtle->x, p_turtle->y, coloring_f(0, path_len), blend_lighten);
+	turtle_op_stream ops;
+	turtle_op op;
+	initialize_turtle_op_stream(&ops, p_stream);
+	while (next_turtle_op(&ops, &op)) {
+		if (op.branch > 0) push_turtle(p_stack, p_turtle);
+		else if (op.branch < 0) pop_turtle(p_stack, p_turtle);
+		turn_turtle(p_turtle, op.turn);
+		for (int64_t i = op.index; i < op.index + op.forward; ++i) {
+			for (int j = 0; j < scale; ++j) {
+				step_turtle(p_turtle);
+				pixel_t pixel = coloring_f(i, path_len);
+				color_point(p_pixmap, p_turtle->x, p_turtle->y, pixel, blend_lighten);
+			}
+		}
+	}
+}
+
+void draw_parametric_path(pixmap_t *p_pixmap, lindenmayer_parametric_system *p_lsystem,
+                          lindenmayer_parametric_path *p_path, turtle_stack *p_stack,
+                          int64_t begin, int64_t end, double start_x, double start_y,
+                          double start_angle, int scale, coloring_f coloring_f)
 {
 	double x = start_x;
 	double y = start_y;
 	double angle = start_angle;
-	int path_len = strlen(path);
 
-	color_point(p_pixmap, x, y, coloring_f(0, path_len), blend_lighten);
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->is_forward[(int)path[i]]) {
-			for (int j = 0; j < scale; ++j) {
-				x += cos(angle);
-				y += sin(angle);
-				pixel_t pixel = coloring_f(i, path_len);
+	color_point(p_pixmap, x, y, coloring_f(begin, p_path->length), blend_lighten);
+	for (int64_t i = begin; i < end; ++i) {
+		char c = p_path->symbols[i];
+		double forward = parametric_forward(p_lsystem, p_path, i) * scale;
+		if (forward != 0) {
+			// Move by steps of about a pixel, like the other systems do
+			int n_steps = ceil(fabs(forward));
+			double dx = forward * cos(angle) / n_steps;
+			double dy = forward * sin(angle) / n_steps;
+			pixel_t pixel = coloring_f(i, p_path->length);
+			for (int j = 0; j < n_steps; ++j) {
+				x += dx;
+				y += dy;
 				color_point(p_pixmap, x, y, pixel, blend_lighten);
 			}
-		} else if (path[i] == '+') {
-				angle += p_lsystem->angle;
-		} else if (path[i] == '-') {
-				angle -= p_lsystem->angle;
+		} else if (c == '[') {
+			push_turtle_state(p_stack, x, y, angle);
+		} else if (c == ']') {
+			pop_turtle_state(p_stack, &x, &y, &angle);
+		} else {
+			angle += parametric_turn(p_lsystem, p_path, i);
 		}
 	}
 }
 
+// Parametric systems have their own paths, which are walked by the turtle
+// module by module
+int run_parametric_system(int n_iterations, int scale, coloring_f *p_coloring)
+{
+	pixmap_t img;
+	lindenmayer_parametric_system lsystem;
+	lindenmayer_parametric_path path;
+	initialize_parametric_tree(&lsystem);
+	initialize_parametric_path(&path, &lsystem);
+	expand_parametric_system(&lsystem, n_iterations, &path);
+	lindenmayer_dp_entry info = scan_parametric_path(&lsystem, &path, NULL, NULL, NULL, 0);
+
+	// Draw the fractal
+	int height = (info.max_x - info.min_x + 10) * scale;
+	int width = (info.max_y - info.min_y + 10) * scale;
+#ifdef IMAGE_FILE
+	if (initialize_file_backed_pixmap(&img, width, height, IMAGE_FILE) != PIXMAP_SUCCESS) {
+#elif defined(TILED_IMAGE)
+	if (initialize_tiled_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#else
+	if (initialize_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#endif
+		clear_parametric_path(&path);
+		clear_parametric_system(&lsystem);
+		return -1;
+	}
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	draw_parametric_path(&img, &lsystem, &path, &stack, 0, path.length,
+		(-info.min_x + 5) * scale, (-info.min_y + 5) * scale, 0, scale, p_coloring);
+	clear_turtle_stack(&stack);
+
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
+	write_pixmap(&img, stdout);
+#endif
+
+	// Free the used memory
+	clear_parametric_path(&path);
+	clear_parametric_system(&lsystem);
+	clear_pixmap(&img);
+	return 0;
+}
+
+// A rectangle of the drawing, in steps from its start, shown on a pixmap
+typedef struct {
+	pixmap_t *p_pixmap;
+	lindenmayer_system *p_lsystem;
+	double min_x, min_y;
+	double scale_x, scale_y; // pixels per step along x (the lines) and y
+	int n_points; // points drawn for every step, about one per pixel
+	int64_t path_len;
+	coloring_f *p_coloring;
+} viewport;
+
+// Draw the step of the forward symbol the turtle is about to draw
+void draw_viewport_step(lindenmayer_turtle_state *p_state, void *p_data)
+{
+	viewport *p_viewport = p_data;
+	turtle turtle;
+	place_turtle(&turtle, p_viewport->p_lsystem, 0, 0, 1, p_state->x, p_state->y,
+		p_state->terms, p_state->heading);
+	double x = turtle.x;
+	double y = turtle.y;
+	step_turtle(&turtle);
+	double dx = (turtle.x - x) / p_viewport->n_points;
+	double dy = (turtle.y - y) / p_viewport->n_points;
+	pixel_t pixel = p_viewport->p_coloring(p_state->index, p_viewport->path_len);
+	for (int j = 1; j <= p_viewport->n_points; ++j) {
+		color_point(p_viewport->p_pixmap, (x + j * dx - p_viewport->min_x) * p_viewport->scale_x,
+			(y + j * dy - p_viewport->min_y) * p_viewport->scale_y, pixel, blend_lighten);
+	}
+}
+
+#ifdef LEVEL_OF_DETAIL
+// Draw a production that fits in a pixel, or that is small enough, as the
+// pixel closest to its center with the color of its middle symbol.
+// Productions that do not move the turtle draw nothing.
+int draw_viewport_production(lindenmayer_turtle_state *p_state, double min_x,
+	double min_y, double max_x, double max_y, int64_t length, void *p_data)
+{
+	viewport *p_viewport = p_data;
+	double top = (min_x - p_viewport->min_x) * p_viewport->scale_x;
+	double left = (min_y - p_viewport->min_y) * p_viewport->scale_y;
+	double bottom = (max_x - p_viewport->min_x) * p_viewport->scale_x;
+	double right = (max_y - p_viewport->min_y) * p_viewport->scale_y;
+	// Round the corners to their closest pixels like color_point does
+	int in_pixel = ceil(top - 0.5) == ceil(bottom - 0.5) &&
+	               ceil(left - 0.5) == ceil(right - 0.5);
+	if (!in_pixel && (bottom - top >= LEVEL_OF_DETAIL_SIZE ||
+	                  right - left >= LEVEL_OF_DETAIL_SIZE)) return 0;
+	if (min_x < max_x || min_y < max_y) {
+		pixel_t pixel = p_viewport->p_coloring(p_state->index + length / 2, p_viewport->path_len);
+		color_point(p_viewport->p_pixmap, (top + bottom) / 2, (left + right) / 2, pixel,
+			blend_lighten);
+	}
+	return 1;
+}
+#endif
+
+// Draw only the part of the fractal in the rectangle from (min_x, min_y) to
+// (max_x, max_y) on an image of the given size, without expanding the rest
+int run_viewport(lindenmayer_system *p_lsystem, int n_iterations, double min_x,
+	double min_y, double max_x, double max_y, int width, int height,
+	coloring_f *p_coloring)
+{
+	if (p_lsystem->is_stochastic || p_lsystem->is_context_sensitive) {
+		fprintf(stderr, "ERROR: Only deterministic systems can be drawn in a viewport.\n");
+		clear_lsystem(p_lsystem);
+		return -1;
+	}
+	if (!(min_x < max_x && min_y < max_y)) {
+		fprintf(stderr, "ERROR: The viewport is empty.\n");
+		clear_lsystem(p_lsystem);
+		return -1;
+	}
+	pixmap_t img;
+#ifdef IMAGE_FILE
+	if (initialize_file_backed_pixmap(&img, width, height, IMAGE_FILE) != PIXMAP_SUCCESS) {
+#elif defined(TILED_IMAGE)
+	if (initialize_tiled_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#else
+	if (initialize_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#endif
+		clear_lsystem(p_lsystem);
+		return -1;
+	}
+	lindenmayer_dp_entry **dp = create_lindenmayer_dp_table(p_lsystem, n_iterations);
+	int64_t **lengths = create_lindenmayer_length_table(p_lsystem, n_iterations);
+
+	viewport viewport;
+	viewport.p_pixmap = &img;
+	viewport.p_lsystem = p_lsystem;
+	viewport.min_x = min_x;
+	viewport.min_y = min_y;
+	viewport.scale_x = height / (max_x - min_x);
+	viewport.scale_y = width / (max_y - min_y);
+	viewport.n_points = ceil(fmax(viewport.scale_x, viewport.scale_y));
+	viewport.path_len = expanded_length(p_lsystem, p_lsystem->start, n_iterations);
+	viewport.p_coloring = p_coloring;
+	color_point(&img, -min_x * viewport.scale_x, -min_y * viewport.scale_y,
+		p_coloring(0, viewport.path_len), blend_lighten);
+	// The points up to a pixel outside the rectangle can still be drawn on it
+	double margin_x = 1 / viewport.scale_x;
+	double margin_y = 1 / viewport.scale_y;
+#ifdef LEVEL_OF_DETAIL
+	walk_lindenmayer_box(p_lsystem, p_lsystem->start, dp, lengths, n_iterations,
+		min_x - margin_x, min_y - margin_y, max_x + margin_x, max_y + margin_y,
+		draw_viewport_step, draw_viewport_production, &viewport);
+#else
+	walk_lindenmayer_box(p_lsystem, p_lsystem->start, dp, lengths, n_iterations,
+		min_x - margin_x, min_y - margin_y, max_x + margin_x, max_y + margin_y,
+		draw_viewport_step, NULL, &viewport);
+#endif
+
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
+	write_pixmap(&img, stdout);
+#endif
+
+	// Free the used memory
+	for (int i = 0; i <= n_iterations; ++i) {
+		free(dp[i]);
+		free(lengths[i]);
+	}
+	free(dp);
+	free(lengths);
+	clear_lsystem(p_lsystem);
+	clear_pixmap(&img);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 5) {
-		fprintf(stderr, "Usage: %s curve_type iterations scaling coloring_type\n", argv[0]);
+	if (argc != 5 && argc != 11) {
+		fprintf(stderr, "Usage: %s curve_type iterations scaling coloring_type "
+		        "[min_x min_y max_x max_y width height]\n", argv[0]);
 		fprintf(stderr, "Curve type is:\n");
 		fprintf(stderr, "   0 = Dragon Curve\n");
 		fprintf(stderr, "   1 = Koch Curve\n");
@@ -47,15 +282,33 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "   3 = Quadratic Gosper\n");
 		fprintf(stderr, "   4 = Levy Curve\n");
 		fprintf(stderr, "   5 = Pentaplexity\n");
+		fprintf(stderr, "   6 = Fractal Plant\n");
+		fprintf(stderr, "   7 = Stochastic Plant\n");
+		fprintf(stderr, "   8 = Parametric Tree\n");
+		fprintf(stderr, "   9 = Context Koch Curve\n");
 		fprintf(stderr, "Coloring type is:\n");
 		fprintf(stderr, "   0 = HSV coloring\n");
 		fprintf(stderr, "   1 = Christmas coloring\n");
+		fprintf(stderr, "With a viewport, only the rectangle from (min_x, min_y) to "
+		        "(max_x, max_y),\n");
+		fprintf(stderr, "in steps from the start of the curve, is drawn on an image "
+		        "of width x height\n");
+		fprintf(stderr, "pixels (x goes down the lines) and the scaling is not used.\n");
 		return -1;
 	}
 	pixmap_t img;
 	lindenmayer_system lsystem;
 	coloring_f *p_coloring;
 
+	if (atoi(argv[1]) == 8) {
+		if (argc == 11) {
+			fprintf(stderr, "ERROR: Parametric systems can not be drawn in a viewport.\n");
+			return -1;
+		}
+		p_coloring = atoi(argv[4]) == 1 ? christmas_coloring : hsv_coloring;
+		return run_parametric_system(atoi(argv[2]), atoi(argv[3]), p_coloring);
+	}
+
 	// Chose the curve type
 	switch (atoi(argv[1])) {
 		case 0:
@@ -76,9 +329,35 @@ int main(int argc, char *argv[])
 		case 5:
 			initialize_pentaplexity(&lsystem);
 			break;
+		case 6:
+			initialize_fractal_plant(&lsystem);
+			break;
+		case 7:
+			initialize_stochastic_plant(&lsystem);
+			break;
+		case 9:
+			initialize_context_koch_curve(&lsystem);
+			break;
 		default:
 			initialize_dragon_curve(&lsystem);
 	}
+	// The symbols that are never drawn only make the paths longer
+	eliminate_dead_symbols(&lsystem);
+#if defined(PACKED_EXPANSION) || defined(FILE_BACKED_EXPANSION) || defined(CACHED_EXPANSION)
+	if (lsystem.is_stochastic) {
+		fprintf(stderr, "ERROR: This expansion can not follow a stochastic derivation.\n");
+		clear_lsystem(&lsystem);
+		return -1;
+	}
+#endif
+#if defined(PACKED_EXPANSION) || defined(FILE_BACKED_EXPANSION) || \
+    defined(CACHED_EXPANSION) || defined(STREAM_EXPANSION)
+	if (lsystem.is_context_sensitive) {
+		fprintf(stderr, "ERROR: This expansion can not look at the neighbours of the symbols.\n");
+		clear_lsystem(&lsystem);
+		return -1;
+	}
+#endif
 	// Choose the coloring type
 	if (atoi(argv[4]) == 1) p_coloring = christmas_coloring;
 	else p_coloring = hsv_coloring;
@@ -86,26 +365,135 @@ int main(int argc, char *argv[])
 	// Find informations about the fractal using dynampic programming
 	int n_iterations = atoi(argv[2]);
 	int scale = atoi(argv[3]);
+	if (argc == 11) {
+		return run_viewport(&lsystem, n_iterations, atof(argv[5]), atof(argv[6]),
+			atof(argv[7]), atof(argv[8]), atoi(argv[9]), atoi(argv[10]), p_coloring);
+	}
+	int status = -1;
 	lindenmayer_dp_entry **dp = create_lindenmayer_dp_table(&lsystem, n_iterations);
-	lindenmayer_dp_entry info = scan_rule(&lsystem, lsystem.start, dp[n_iterations],
-		compute_no_of_variables(&lsystem), 1, NULL, NULL, 0);
+	// The expansions of the symbols of context sensitive systems are kept, to
+	// be joined instead of expanding the start again
+	lindenmayer_path_scan scan;
+	scan_varying_path(&lsystem, lsystem.start, NULL, n_iterations, 1, &scan);
+	lindenmayer_dp_entry info = scan_path(&lsystem, lsystem.start, &scan, dp, n_iterations,
+		NULL, NULL, NULL, 0);
 
-	// Draw the fractal
-	char *path = expand_lsystem(&lsystem, n_iterations);
+	// The pixmap is allocated before the expansion, which is not needed if
+	// it fails
 	int height = (info.max_x - info.min_x + 10) * scale;
 	int width = (info.max_y - info.min_y + 10) * scale;
-	initialize_pixmap(&img, width, height);
-	draw_path(&img, &lsystem, path, (-info.min_x + 5) * scale, (-info.min_y + 5) * scale, 0, scale, p_coloring);
+#ifdef IMAGE_FILE
+	if (initialize_file_backed_pixmap(&img, width, height, IMAGE_FILE) != PIXMAP_SUCCESS) {
+#elif defined(TILED_IMAGE)
+	if (initialize_tiled_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#else
+	if (initialize_pixmap(&img, width, height) != PIXMAP_SUCCESS) {
+#endif
+		goto clear_system;
+	}
 
-#ifndef DONT_WRITE_IMAGE
+	// Draw the fractal
+	lindenmayer_stream stream;
+#if defined(EXPANSION_FILE_DIRECTORY)
+	char *path = NULL;
+	expansion_file file;
+	char file_name[4096];
+	snprintf(file_name, sizeof(file_name), "%s/lindenmayer-%016" PRIx64 "-%d.lsx",
+	         EXPANSION_FILE_DIRECTORY, hash_lsystem(&lsystem), n_iterations);
+	if (map_expansion_file(&file, file_name, &lsystem, n_iterations) != LINDENMAYER_SUCCESS) {
+		char *expanded_path = lsystem.is_context_sensitive ?
+			join_path_scan(&scan, lsystem.start, 0, strlen(lsystem.start), NULL) :
+			expand_lsystem(&lsystem, n_iterations);
+		int status = write_expansion_file(file_name, &lsystem, n_iterations, expanded_path,
+		                                  strlen(expanded_path), &info);
+		free(expanded_path);
+		if (status != LINDENMAYER_SUCCESS ||
+		    map_expansion_file(&file, file_name, &lsystem, n_iterations) != LINDENMAYER_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not map expansion file %s.\n", file_name);
+			clear_pixmap(&img);
+			goto clear_system;
+		}
+	}
+	info = file.info;
+	int64_t path_len = file.length;
+	initialize_lsystem_stream(&stream, &lsystem, file.path, 0);
+#elif defined(PACKED_EXPANSION)
+	char *path = NULL;
+	lindenmayer_packed_path packed;
+	if (expand_packed_lsystem(&lsystem, n_iterations, 1, &packed) != LINDENMAYER_SUCCESS) {
+		clear_pixmap(&img);
+		goto clear_system;
+	}
+	int64_t path_len = packed.length;
+	initialize_packed_stream(&stream, &lsystem, &packed, 0);
+#elif defined(FILE_BACKED_EXPANSION)
+	char *path = NULL;
+	lindenmayer_arena arena;
+	int64_t start_len = strlen(lsystem.start);
+	if (initialize_file_backed_arena(&arena, &lsystem, lsystem.start, start_len,
+	                                 n_iterations, FILE_BACKED_EXPANSION) != LINDENMAYER_SUCCESS) {
+		clear_pixmap(&img);
+		goto clear_system;
+	}
+	char *expanded_path = expand_in_arena(&lsystem, &arena, lsystem.start, start_len,
+	                                      n_iterations);
+	int64_t path_len = strlen(expanded_path);
+	initialize_lsystem_stream(&stream, &lsystem, expanded_path, 0);
+#elif defined(CACHED_EXPANSION)
+	lindenmayer_cache cache;
+	initialize_lsystem_cache(&cache, &lsystem, n_iterations);
+	int64_t path_len = expanded_length(&lsystem, lsystem.start, n_iterations);
+	char *path = malloc((path_len + 1) * sizeof(char));
+	expand_with_cache(&lsystem, &cache, lsystem.start, strlen(lsystem.start),
+	                  n_iterations, path);
+	clear_lsystem_cache(&cache);
+	initialize_lsystem_stream(&stream, &lsystem, path, 0);
+#elif defined(STREAM_EXPANSION)
+	char *path = NULL;
+	int64_t path_len = expanded_length(&lsystem, lsystem.start, n_iterations);
+	if (lsystem.is_stochastic) {
+		// The lengths of the rules do not hold for a stochastic derivation
+		initialize_lsystem_stream(&stream, &lsystem, lsystem.start, n_iterations);
+		for (path_len = 0; next_symbol(&stream) != '\0'; ++path_len);
+		clear_lsystem_stream(&stream);
+	}
+	initialize_lsystem_stream(&stream, &lsystem, lsystem.start, n_iterations);
+#else
+	char *path = lsystem.is_context_sensitive ?
+		join_path_scan(&scan, lsystem.start, 0, strlen(lsystem.start), NULL) :
+		expand_lsystem(&lsystem, n_iterations);
+	int64_t path_len = strlen(path);
+	initialize_lsystem_stream(&stream, &lsystem, path, 0);
+#endif
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	turtle turtle;
+	int64_t start_terms[EXACT_MAX_TERMS] = {0};
+	place_turtle(&turtle, &lsystem, (-info.min_x + 5) * scale, (-info.min_y + 5) * scale,
+		scale, 0, 0, start_terms, 0);
+	draw_path(&img, &stream, &stack, path_len, &turtle, scale, p_coloring);
+	clear_turtle_stack(&stack);
+	clear_lsystem_stream(&stream);
+#if defined(EXPANSION_FILE_DIRECTORY)
+	unmap_expansion_file(&file);
+#elif defined(PACKED_EXPANSION)
+	clear_packed_path(&packed);
+#elif defined(FILE_BACKED_EXPANSION)
+	clear_arena(&arena);
+#endif
+
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
 	write_pixmap(&img, stdout);
 #endif
+	free(path);
+	clear_pixmap(&img);
+	status = 0;
 
-	// Free the used memory
+	// Free the used memory, also when the drawing failed
+clear_system:
 	for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
 	free(dp);
+	clear_path_scan(&scan);
 	clear_lsystem(&lsystem);
-	free(path);
-	clear_pixmap(&img);
-	return 0;
+	return status;
 }
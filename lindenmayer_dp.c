@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lindenmayer_dp.h"
 
@@ -32,59 +33,288 @@ void attach_variable_names(lindenmayer_system *p_lsystem, lindenmayer_dp_entry *
 	}
 }
 
+// Set the box of the drawing described by ans from its extents along the axes
+static void update_box(lindenmayer_system *p_lsystem, lindenmayer_dp_entry *p_ans)
+{
+	int quarter = p_lsystem->n_directions / 4;
+	p_ans->max_x = p_ans->extents[0];
+	p_ans->max_y = p_ans->extents[quarter];
+	p_ans->min_x = -p_ans->extents[2 * quarter];
+	p_ans->min_y = -p_ans->extents[3 * quarter];
+}
+
+// Store in turned the extents of a drawing turned by the given heading. When
+// the heading does not turn by whole directions, the extent in a direction
+// between two others is the one of the corner where their extents meet.
+static void turn_extents(lindenmayer_system *p_lsystem, double *extents,
+	int64_t heading, double *turned)
+{
+	int n_directions = p_lsystem->n_directions;
+	if (p_lsystem->direction_shift != 0) {
+		int shift = (heading * p_lsystem->direction_shift) % n_directions;
+		if (shift < 0) shift += n_directions;
+		for (int k = 0; k < n_directions; ++k) {
+			turned[k] = extents[(k - shift + n_directions) % n_directions];
+		}
+		return;
+	}
+	// Direction k of the turned drawing is between the directions first and
+	// first + 1 of the drawing
+	double step = 2 * PI / n_directions;
+	double position = -fmod(heading * p_lsystem->angle, 2 * PI) / step;
+	double first = floor(position);
+	double a = sin((1 - (position - first)) * step) / sin(step);
+	double b = sin((position - first) * step) / sin(step);
+	int shift = (int)first % n_directions;
+	if (shift < 0) shift += n_directions;
+	for (int k = 0; k < n_directions; ++k) {
+		turned[k] = a * extents[(k + shift) % n_directions] +
+		            b * extents[(k + shift + 1) % n_directions];
+	}
+}
+
+// Continue the drawing described by ans with the one described by the given
+// entry, turned by the heading ans ends with
+static void append_entry(lindenmayer_system *p_lsystem, lindenmayer_dp_entry *p_ans,
+	lindenmayer_dp_entry *p_entry)
+{
+	double turned[MAX_BOUND_DIRECTIONS];
+	turn_extents(p_lsystem, p_entry->extents, p_ans->heading, turned);
+	for (int k = 0; k < p_lsystem->n_directions; ++k) {
+		double offset = p_ans->x * p_lsystem->direction_x[k] +
+		                p_ans->y * p_lsystem->direction_y[k];
+		p_ans->extents[k] = max(p_ans->extents[k], offset + turned[k]);
+	}
+	update_box(p_lsystem, p_ans);
+	double cos_tmp, sin_tmp;
+	heading_vector(p_lsystem, -p_ans->heading, &cos_tmp, &sin_tmp);
+	p_ans->x += cos_tmp * p_entry->x + sin_tmp * p_entry->y;
+	p_ans->y += -sin_tmp * p_entry->x + cos_tmp * p_entry->y;
+	if (p_lsystem->n_terms > 0) {
+		add_turned_terms(p_lsystem, p_ans->terms, p_entry->terms, p_ans->heading);
+	}
+	p_ans->heading += p_entry->heading;
+}
+
+// Start the drawing described by ans at (0, 0) with starting heading = 0
+static void initialize_entry(lindenmayer_dp_entry *p_ans)
+{
+	p_ans->x = p_ans->y = p_ans->angle = 0;
+	p_ans->heading = 0;
+	memset(p_ans->terms, 0, sizeof(p_ans->terms));
+	p_ans->min_x = p_ans->max_x = 0;
+	p_ans->min_y = p_ans->max_y = 0;
+	memset(p_ans->extents, 0, sizeof(p_ans->extents));
+}
+
+// The exact position of a single step facing heading 0
+static int64_t unit_terms[EXACT_MAX_TERMS] = {1};
+
+// Continue the drawing described by ans with the given symbol, not expanded
+static void append_symbol(lindenmayer_system *p_lsystem, lindenmayer_dp_entry *p_ans,
+	turtle_stack *p_stack, char c)
+{
+	if (p_lsystem->is_forward[(int)c]) {
+		double dx, dy;
+		heading_vector(p_lsystem, p_ans->heading, &dx, &dy);
+		p_ans->x += dx;
+		p_ans->y += dy;
+		for (int k = 0; k < p_lsystem->n_directions; ++k) {
+			double extent = p_ans->x * p_lsystem->direction_x[k] +
+			                p_ans->y * p_lsystem->direction_y[k];
+			p_ans->extents[k] = max(p_ans->extents[k], extent);
+		}
+		update_box(p_lsystem, p_ans);
+		if (p_lsystem->n_terms > 0) {
+			add_turned_terms(p_lsystem, p_ans->terms, unit_terms, p_ans->heading);
+		}
+	} else if (c == '+') {
+		++p_ans->heading;
+	} else if (c == '-') {
+		--p_ans->heading;
+	} else if (c == '[') {
+		push_turtle_heading(p_stack, p_ans->x, p_ans->y, p_ans->heading, p_ans->terms);
+	} else if (c == ']') {
+		pop_turtle_heading(p_stack, &p_ans->x, &p_ans->y, &p_ans->heading, p_ans->terms);
+	}
+}
+
 lindenmayer_dp_entry scan_rule(lindenmayer_system *p_lsystem, char *rule,
-	lindenmayer_dp_entry *previous_entries, int n_variables, int do_expand,
-	lindenmayer_dp_entry *polls, int *starting, int n_polls)
+	lindenmayer_dp_entry *previous_entries, int do_expand,
+	lindenmayer_dp_entry *polls, turtle_stack *stacks, int *starting, int n_polls)
 {
 	lindenmayer_dp_entry ans;
-	ans.x = ans.y = ans.angle = 0;
-	ans.min_x = ans.max_x = 0;
-	ans.min_y = ans.max_y = 0;
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	initialize_entry(&ans);
 	for (int i_poll = 0, j = 0; rule[j] != '\0'; ++j) {
 		if (polls != NULL && i_poll < n_polls && starting[i_poll] == j) {
-			ans.angle = fmod(ans.angle, 2 * PI);
+			if (stacks != NULL) copy_turtle_stack(&stacks[i_poll], &stack);
 			polls[i_poll++] = ans;
 		}
 		if (p_lsystem->rules[(int)rule[j]] != NULL && do_expand) {
-			int k;
-			for (k = 0; k < n_variables; ++k) {
-				if (previous_entries[k].variable == rule[j]) break;
-			}
-			double cos_tmp = cos(-ans.angle);
-			double sin_tmp = sin(-ans.angle);
-			double x1 = cos_tmp * previous_entries[k].max_x + sin_tmp * previous_entries[k].min_y;
-			double x2 = cos_tmp * previous_entries[k].min_x + sin_tmp * previous_entries[k].min_y;
-			double x3 = cos_tmp * previous_entries[k].max_x + sin_tmp * previous_entries[k].max_y;
-			double x4 = cos_tmp * previous_entries[k].min_x + sin_tmp * previous_entries[k].max_y;
-			double y1 = -sin_tmp * previous_entries[k].min_x + cos_tmp * previous_entries[k].min_y;
-			double y2 = -sin_tmp * previous_entries[k].min_x + cos_tmp * previous_entries[k].max_y;
-			double y3 = -sin_tmp * previous_entries[k].max_x + cos_tmp * previous_entries[k].min_y;
-			double y4 = -sin_tmp * previous_entries[k].max_x + cos_tmp * previous_entries[k].max_y;
-			double min_x = ans.x + min(min(x1, x2), min(x3, x4));
-			double max_x = ans.x + max(max(x1, x2), max(x3, x4));
-			double min_y = ans.y + min(min(y1, y2), min(y3, y4));
-			double max_y = ans.y + max(max(y1, y2), max(y3, y4));
-			ans.x += cos_tmp * previous_entries[k].x + sin_tmp * previous_entries[k].y;
-			ans.y += -sin_tmp * previous_entries[k].x + cos_tmp * previous_entries[k].y;
-			ans.min_x = min(ans.min_x, min_x);
-			ans.max_x = max(ans.max_x, max_x);
-			ans.min_y = min(ans.min_y, min_y);
-			ans.max_y = max(ans.max_y, max_y);
-			ans.angle += previous_entries[k].angle;
-		} else if (p_lsystem->is_forward[(int)rule[j]]) {
-			ans.x += cos(ans.angle);
-			ans.y += sin(ans.angle);
-			ans.min_x = min(ans.min_x, ans.x);
-			ans.max_x = max(ans.max_x, ans.x);
-			ans.min_y = min(ans.min_y, ans.y);
-			ans.max_y = max(ans.max_y, ans.y);
-		} else if (rule[j] == '+') {
-			ans.angle += p_lsystem->angle;
-		} else if (rule[j] == '-') {
-			ans.angle -= p_lsystem->angle;
+			int id = p_lsystem->rule_id[(uint8_t)rule[j]];
+			append_entry(p_lsystem, &ans, &previous_entries[id - 1]);
+		} else {
+			append_symbol(p_lsystem, &ans, &stack, rule[j]);
 		}
 	}
-	ans.angle = fmod(ans.angle, 2 * PI);
+	clear_turtle_stack(&stack);
+	return ans;
+}
+
+// Return the entry of the given symbol of a stochastic system, which has a
+// production and is at the given derivation node, expanded for n > 0 times.
+// Its length and number of forward steps are added to the given counters.
+static lindenmayer_dp_entry scan_node(lindenmayer_system *p_lsystem, char c,
+	uint64_t node, int n, int64_t *p_length, int64_t *p_forward)
+{
+	lindenmayer_dp_entry ans;
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	initialize_entry(&ans);
+	char *rule = choose_production(p_lsystem, c, node);
+	for (int k = 0; rule[k] != '\0'; ++k) {
+		if (n > 1 && p_lsystem->rules[(int)rule[k]] != NULL) {
+			lindenmayer_dp_entry entry = scan_node(p_lsystem, rule[k],
+				derivation_node(node, k), n - 1, p_length, p_forward);
+			append_entry(p_lsystem, &ans, &entry);
+		} else {
+			append_symbol(p_lsystem, &ans, &stack, rule[k]);
+			++*p_length;
+			if (p_lsystem->is_forward[(int)rule[k]]) ++*p_forward;
+		}
+	}
+	clear_turtle_stack(&stack);
+	return ans;
+}
+
+// Return the entry of the given expanded path, which is not expanded further.
+// Its length and number of forward steps are added to the given counters.
+static lindenmayer_dp_entry scan_expanded(lindenmayer_system *p_lsystem, char *path,
+	int64_t path_len, int64_t *p_length, int64_t *p_forward)
+{
+	*p_length += path_len;
+	for (int64_t j = 0; j < path_len; ++j) {
+		if (p_lsystem->is_forward[(uint8_t)path[j]]) ++*p_forward;
+	}
+	return scan_rule(p_lsystem, path, NULL, 0, NULL, NULL, NULL, 0);
+}
+
+void scan_varying_path(lindenmayer_system *p_lsystem, char *path,
+	uint64_t *nodes, int n, int keep_expansions, lindenmayer_path_scan *p_scan)
+{
+	p_scan->path_len = 0;
+	p_scan->expansions = NULL;
+	if (!p_lsystem->is_stochastic && !p_lsystem->is_context_sensitive) {
+		p_scan->entries = NULL;
+		p_scan->lengths = p_scan->forward = NULL;
+		return;
+	}
+	int64_t path_len = strlen(path);
+	p_scan->path_len = path_len;
+	p_scan->entries = malloc(path_len * sizeof(lindenmayer_dp_entry));
+	p_scan->lengths = malloc(path_len * sizeof(int64_t));
+	p_scan->forward = malloc(path_len * sizeof(int64_t));
+	if (keep_expansions && p_lsystem->is_context_sensitive) {
+		p_scan->expansions = calloc(path_len, sizeof(char *));
+	}
+	lindenmayer_dp_entry *entries = p_scan->entries;
+	int64_t *lengths = p_scan->lengths;
+	int64_t *forward = p_scan->forward;
+	// Every occurrence of a symbol can expand differently, so the derivation
+	// of every symbol of the path is walked, or it is expanded with its halo
+	#pragma omp parallel for schedule(dynamic)
+	for (int64_t j = 0; j < path_len; ++j) {
+		char c = path[j];
+		int has_rule = p_lsystem->rules[(int)c] != NULL ||
+		               p_lsystem->n_context_rules[(uint8_t)c] > 0;
+		if (n > 0 && has_rule && p_lsystem->is_context_sensitive) {
+			int64_t len;
+			char *expanded = expand_with_halo(p_lsystem, path, path_len, j, j + 1, n, &len);
+			lengths[j] = forward[j] = 0;
+			entries[j] = scan_expanded(p_lsystem, expanded, len, &lengths[j], &forward[j]);
+			if (p_scan->expansions != NULL) p_scan->expansions[j] = expanded;
+			else free(expanded);
+		} else if (n > 0 && has_rule) {
+			uint64_t node = nodes != NULL ? nodes[j] : derivation_node(p_lsystem->seed, j);
+			lengths[j] = forward[j] = 0;
+			entries[j] = scan_node(p_lsystem, c, node, n, &lengths[j], &forward[j]);
+		} else {
+			lengths[j] = 1;
+			forward[j] = p_lsystem->is_forward[(int)c] ? 1 : 0;
+		}
+	}
+}
+
+char *join_path_scan(lindenmayer_path_scan *p_scan, char *path, int64_t begin,
+	int64_t end, int64_t *p_len)
+{
+	int64_t len = 0;
+	for (int64_t j = begin; j < end; ++j) len += p_scan->lengths[j];
+	char *joined = malloc((len + 1) * sizeof(char));
+	for (int64_t k = 0, j = begin; j < end; ++j) {
+		if (p_scan->expansions[j] == NULL) {
+			joined[k++] = path[j];
+			continue;
+		}
+		memcpy(joined + k, p_scan->expansions[j], p_scan->lengths[j]);
+		k += p_scan->lengths[j];
+		free(p_scan->expansions[j]);
+		p_scan->expansions[j] = NULL;
+	}
+	joined[len] = '\0';
+	if (p_len != NULL) *p_len = len;
+	return joined;
+}
+
+void clear_path_scan(lindenmayer_path_scan *p_scan)
+{
+	if (p_scan->expansions != NULL) {
+		for (int64_t j = 0; j < p_scan->path_len; ++j) free(p_scan->expansions[j]);
+		free(p_scan->expansions);
+		p_scan->expansions = NULL;
+	}
+	free(p_scan->entries);
+	free(p_scan->lengths);
+	free(p_scan->forward);
+	p_scan->entries = NULL;
+	p_scan->lengths = p_scan->forward = NULL;
+}
+
+lindenmayer_dp_entry scan_path(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_path_scan *p_scan, lindenmayer_dp_entry **dp, int n,
+	lindenmayer_dp_entry *polls, turtle_stack *stacks, int *starting, int n_polls)
+{
+	if (!p_lsystem->is_stochastic && !p_lsystem->is_context_sensitive) {
+		return scan_rule(p_lsystem, path, dp[n], n > 0, polls, stacks, starting,
+		                 n_polls);
+	}
+	int64_t path_len = strlen(path);
+	lindenmayer_path_scan scan;
+	if (p_scan == NULL) {
+		scan_varying_path(p_lsystem, path, NULL, n, 0, &scan);
+		p_scan = &scan;
+	}
+
+	lindenmayer_dp_entry ans;
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	initialize_entry(&ans);
+	for (int i_poll = 0, j = 0; j < path_len; ++j) {
+		if (polls != NULL && i_poll < n_polls && starting[i_poll] == j) {
+			if (stacks != NULL) copy_turtle_stack(&stacks[i_poll], &stack);
+			polls[i_poll++] = ans;
+		}
+		if (n > 0 && (p_lsystem->rules[(int)path[j]] != NULL ||
+		              p_lsystem->n_context_rules[(uint8_t)path[j]] > 0)) {
+			append_entry(p_lsystem, &ans, &p_scan->entries[j]);
+		} else {
+			append_symbol(p_lsystem, &ans, &stack, path[j]);
+		}
+	}
+	clear_turtle_stack(&stack);
+	if (p_scan == &scan) clear_path_scan(&scan);
 	return ans;
 }
 
@@ -98,11 +328,7 @@ lindenmayer_dp_entry **create_lindenmayer_dp_table(
 
 	// Base case
 	if (n == 0) {
-		for (int i = 0; i < n_variables; ++i) {
-			ans[0][i].angle = ans[0][i].x = ans[0][i].y = 0;
-			ans[0][i].min_x = ans[0][i].max_x = 0;
-			ans[0][i].min_y = ans[0][i].max_y = 0;
-		}
+		for (int i = 0; i < n_variables; ++i) initialize_entry(&ans[0][i]);
 		return ans;
 	}
 
@@ -113,8 +339,394 @@ lindenmayer_dp_entry **create_lindenmayer_dp_table(
 	for (int i = 0; i < n_variables; ++i) {
 		char tmp = ans[n][i].variable;
 		ans[n][i] = scan_rule(p_lsystem, p_lsystem->rules[(int)ans[n][i].variable],
-		                      ans[n - 1], n_variables, n > 1 ? 1 : 0, NULL, NULL, 0);
+		                      ans[n - 1], n > 1 ? 1 : 0, NULL, NULL, NULL, 0);
 		ans[n][i].variable = tmp;
 	}
 	return ans;
 }
+
+// Return the table of a value that adds up over the productions, given its
+// value for every symbol that is not expanded
+static int64_t **create_symbol_table(lindenmayer_system *p_lsystem, int n,
+	int64_t *base)
+{
+	int64_t **ans = malloc((n + 1) * sizeof(int64_t *));
+	ans[0] = malloc(256 * sizeof(int64_t));
+	memcpy(ans[0], base, 256 * sizeof(int64_t));
+	for (int i = 1; i <= n; ++i) {
+		ans[i] = malloc(256 * sizeof(int64_t));
+		for (int c = 0; c < 256; ++c) {
+			if (p_lsystem->rules[c] == NULL) {
+				ans[i][c] = base[c];
+				continue;
+			}
+			ans[i][c] = 0;
+			for (int k = 0; p_lsystem->rules[c][k] != '\0'; ++k) {
+				ans[i][c] += ans[i - 1][(uint8_t)p_lsystem->rules[c][k]];
+			}
+		}
+	}
+	return ans;
+}
+
+int64_t **create_lindenmayer_length_table(lindenmayer_system *p_lsystem, int n)
+{
+	int64_t base[256];
+	for (int c = 0; c < 256; ++c) base[c] = 1;
+	return create_symbol_table(p_lsystem, n, base);
+}
+
+int64_t **create_lindenmayer_forward_table(lindenmayer_system *p_lsystem, int n)
+{
+	int64_t base[256];
+	for (int c = 0; c < 256; ++c) base[c] = p_lsystem->is_forward[c] ? 1 : 0;
+	return create_symbol_table(p_lsystem, n, base);
+}
+
+// Multiply the given size x size matrices into ans. The lengths are counted
+// modulo 2^64, as they would overflow anyway.
+static void multiply_matrices(uint64_t *a, uint64_t *b, uint64_t *ans, int size)
+{
+	for (int i = 0; i < size; ++i) {
+		for (int j = 0; j < size; ++j) {
+			uint64_t sum = 0;
+			for (int k = 0; k < size; ++k) sum += a[i * size + k] * b[k * size + j];
+			ans[i * size + j] = sum;
+		}
+	}
+}
+
+// Compute in values the sum of base over the symbols of every symbol expanded
+// for n times, by raising the matrix which counts the symbols of every rule to
+// the n-th power
+static void power_symbol_values(lindenmayer_system *p_lsystem, int n,
+	int64_t *base, int64_t *values)
+{
+	// Row id - 1 counts the symbols of the rule with the given id, split by
+	// the rule that expands them. The last column, which takes the place of
+	// the id 0, sums the base of the symbols without rules as they are left as
+	// they are, and its row keeps that sum.
+	int size = p_lsystem->n_rules;
+	uint64_t *matrix = calloc(size * size, sizeof(uint64_t));
+	uint64_t *power = calloc(size * size, sizeof(uint64_t));
+	uint64_t *tmp = malloc(size * size * sizeof(uint64_t));
+	uint64_t *initial = malloc(size * sizeof(uint64_t));
+	for (int c = 0; c < 256; ++c) {
+		int id = p_lsystem->rule_id[c];
+		if (id == 0) continue;
+		initial[id - 1] = base[c];
+		for (int k = 0; p_lsystem->rules[c][k] != '\0'; ++k) {
+			uint8_t next = p_lsystem->rules[c][k];
+			int next_id = p_lsystem->rule_id[next];
+			if (next_id == 0) matrix[(id - 1) * size + size - 1] += base[next];
+			else ++matrix[(id - 1) * size + next_id - 1];
+		}
+	}
+	initial[size - 1] = 1;
+	matrix[size * size - 1] = 1;
+	for (int i = 0; i < size; ++i) power[i * size + i] = 1;
+
+	// Raise the matrix to the n-th power by repeated squaring
+	for (; n > 0; n /= 2) {
+		if (n % 2 == 1) {
+			multiply_matrices(power, matrix, tmp, size);
+			memcpy(power, tmp, size * size * sizeof(uint64_t));
+		}
+		multiply_matrices(matrix, matrix, tmp, size);
+		memcpy(matrix, tmp, size * size * sizeof(uint64_t));
+	}
+	for (int c = 0; c < 256; ++c) {
+		int id = p_lsystem->rule_id[c];
+		if (id == 0) {
+			values[c] = base[c];
+			continue;
+		}
+		uint64_t value = 0;
+		for (int j = 0; j < size; ++j) value += power[(id - 1) * size + j] * initial[j];
+		values[c] = value;
+	}
+	free(matrix);
+	free(power);
+	free(tmp);
+	free(initial);
+}
+
+void compute_expanded_lengths(lindenmayer_system *p_lsystem, int n,
+	int64_t *lengths)
+{
+	int64_t base[256];
+	for (int c = 0; c < 256; ++c) base[c] = 1;
+	power_symbol_values(p_lsystem, n, base, lengths);
+}
+
+void compute_expanded_forward(lindenmayer_system *p_lsystem, int n,
+	int64_t *forward)
+{
+	int64_t base[256];
+	for (int c = 0; c < 256; ++c) base[c] = p_lsystem->is_forward[c] ? 1 : 0;
+	power_symbol_values(p_lsystem, n, base, forward);
+}
+
+void partition_by_cost(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_path_scan *p_scan, int n, int n_parts, int *starting, int64_t *offsets)
+{
+	// Find the expanded length and the forward steps of every symbol
+	int path_len = strlen(path);
+	int64_t *costs = malloc(path_len * sizeof(int64_t));
+	int64_t *symbol_lengths = malloc(path_len * sizeof(int64_t));
+	if (p_lsystem->is_stochastic || p_lsystem->is_context_sensitive) {
+		lindenmayer_path_scan scan;
+		if (p_scan == NULL) {
+			scan_varying_path(p_lsystem, path, NULL, n, 0, &scan);
+			p_scan = &scan;
+		}
+		memcpy(costs, p_scan->forward, path_len * sizeof(int64_t));
+		memcpy(symbol_lengths, p_scan->lengths, path_len * sizeof(int64_t));
+		if (p_scan == &scan) clear_path_scan(&scan);
+	} else {
+		// Only the last line of the tables is needed, which the powers of the
+		// rules give without the lines before it
+		int64_t lengths[256], forward[256];
+		compute_expanded_lengths(p_lsystem, n, lengths);
+		compute_expanded_forward(p_lsystem, n, forward);
+		for (int j = 0; j < path_len; ++j) {
+			costs[j] = forward[(uint8_t)path[j]];
+			symbol_lengths[j] = lengths[(uint8_t)path[j]];
+		}
+	}
+	int64_t total_cost = 0;
+	for (int j = 0; j < path_len; ++j) total_cost += costs[j];
+
+	// Chunk i starts at the symbol whose middle is the first one after i /
+	// n_parts of the cost, keeping at least one symbol for every chunk
+	int64_t cost = 0, offset = 0;
+	starting[0] = 0;
+	offsets[0] = 0;
+	for (int i = 1, j = 0; j < path_len; ++j) {
+		if (i < n_parts && j > starting[i - 1] &&
+		    ((2 * cost + costs[j]) * n_parts > 2 * i * total_cost ||
+		     path_len - j <= n_parts - i)) {
+			starting[i] = j;
+			offsets[i++] = offset;
+		}
+		cost += costs[j];
+		offset += symbol_lengths[j];
+	}
+	starting[n_parts] = path_len;
+	offsets[n_parts] = offset;
+	free(costs);
+	free(symbol_lengths);
+}
+
+// Move the turtle over the drawing described by the given entry
+static void move_over_entry(lindenmayer_system *p_lsystem,
+	lindenmayer_turtle_state *p_state, lindenmayer_dp_entry *p_entry)
+{
+	double cos_tmp, sin_tmp;
+	heading_vector(p_lsystem, -p_state->heading, &cos_tmp, &sin_tmp);
+	p_state->x += cos_tmp * p_entry->x + sin_tmp * p_entry->y;
+	p_state->y += -sin_tmp * p_entry->x + cos_tmp * p_entry->y;
+	if (p_lsystem->n_terms > 0) {
+		add_turned_terms(p_lsystem, p_state->terms, p_entry->terms, p_state->heading);
+	}
+	p_state->heading += p_entry->heading;
+}
+
+// Move the turtle by the given symbol, not expanded
+static void move_by_symbol(lindenmayer_system *p_lsystem,
+	lindenmayer_turtle_state *p_state, turtle_stack *p_stack, char c)
+{
+	if (p_lsystem->is_forward[(int)c]) {
+		double dx, dy;
+		heading_vector(p_lsystem, p_state->heading, &dx, &dy);
+		p_state->x += dx;
+		p_state->y += dy;
+		if (p_lsystem->n_terms > 0) {
+			add_turned_terms(p_lsystem, p_state->terms, unit_terms, p_state->heading);
+		}
+	} else if (c == '+') {
+		++p_state->heading;
+	} else if (c == '-') {
+		--p_state->heading;
+	} else if (c == '[') {
+		push_turtle_heading(p_stack, p_state->x, p_state->y, p_state->heading,
+		                    p_state->terms);
+	} else if (c == ']') {
+		pop_turtle_heading(p_stack, &p_state->x, &p_state->y, &p_state->heading,
+		                   p_state->terms);
+	}
+}
+
+lindenmayer_turtle_state seek_lindenmayer_dp(lindenmayer_system *p_lsystem,
+	char *path, lindenmayer_dp_entry **dp, int64_t **lengths, int n,
+	int64_t offset, turtle_stack *p_stack)
+{
+	lindenmayer_turtle_state ans;
+	ans.x = ans.y = 0;
+	ans.heading = 0;
+	memset(ans.terms, 0, sizeof(ans.terms));
+	ans.index = offset;
+	char *rule = path;
+	for (int j = 0, level = n; rule[j] != '\0'; ++j) {
+		char c = rule[j];
+		if (offset < lengths[level][(uint8_t)c]) {
+			if (offset == 0) break;
+			// The symbol is inside this production, continue with it
+			rule = p_lsystem->rules[(int)c];
+			j = -1;
+			--level;
+			continue;
+		}
+		offset -= lengths[level][(uint8_t)c];
+		if (p_lsystem->rules[(int)c] != NULL && level > 0) {
+			// Move over the whole production using the previous entries
+			lindenmayer_dp_entry *p_entry = &dp[level][p_lsystem->rule_id[(uint8_t)c] - 1];
+			move_over_entry(p_lsystem, &ans, p_entry);
+		} else {
+			move_by_symbol(p_lsystem, &ans, p_stack, c);
+		}
+	}
+	return ans;
+}
+
+typedef struct {
+	lindenmayer_system *p_lsystem;
+	lindenmayer_dp_entry **dp;
+	int64_t **lengths;
+	double min_x, min_y;
+	double max_x, max_y;
+	lindenmayer_visit_f *visit;
+	lindenmayer_collapse_f *collapse;
+	void *p_data;
+	lindenmayer_turtle_state state;
+	turtle_stack stack;
+} lindenmayer_box_walk;
+
+// Store the bounding box of the drawing described by the given entry, started
+// from the state of the walk
+static void turn_entry_box(lindenmayer_box_walk *p_walk, lindenmayer_dp_entry *p_entry,
+	double *p_min_x, double *p_min_y, double *p_max_x, double *p_max_y)
+{
+	lindenmayer_system *p_lsystem = p_walk->p_lsystem;
+	int quarter = p_lsystem->n_directions / 4;
+	double turned[MAX_BOUND_DIRECTIONS];
+	turn_extents(p_lsystem, p_entry->extents, p_walk->state.heading, turned);
+	*p_min_x = p_walk->state.x - turned[2 * quarter];
+	*p_max_x = p_walk->state.x + turned[0];
+	*p_min_y = p_walk->state.y - turned[3 * quarter];
+	*p_max_y = p_walk->state.y + turned[quarter];
+}
+
+// Walk the given rule, whose symbols are expanded for level times
+static void walk_box_rule(lindenmayer_box_walk *p_walk, char *rule, int level)
+{
+	lindenmayer_system *p_lsystem = p_walk->p_lsystem;
+	lindenmayer_turtle_state *p_state = &p_walk->state;
+	for (int j = 0; rule[j] != '\0'; ++j) {
+		char c = rule[j];
+		if (p_lsystem->rules[(int)c] != NULL && level > 0) {
+			lindenmayer_dp_entry *p_entry = &p_walk->dp[level][p_lsystem->rule_id[(uint8_t)c] - 1];
+			double min_x, min_y, max_x, max_y;
+			turn_entry_box(p_walk, p_entry, &min_x, &min_y, &max_x, &max_y);
+			int64_t length = p_walk->lengths[level][(uint8_t)c];
+			// Move over the productions that can not meet the box or that are
+			// drawn at once
+			if (max_x < p_walk->min_x || min_x > p_walk->max_x ||
+			    max_y < p_walk->min_y || min_y > p_walk->max_y ||
+			    (p_walk->collapse != NULL &&
+			     p_walk->collapse(p_state, min_x, min_y, max_x, max_y, length, p_walk->p_data))) {
+				move_over_entry(p_lsystem, p_state, p_entry);
+				p_state->index += length;
+			} else {
+				walk_box_rule(p_walk, p_lsystem->rules[(int)c], level - 1);
+			}
+			continue;
+		}
+		if (p_lsystem->is_forward[(int)c]) p_walk->visit(p_state, p_walk->p_data);
+		move_by_symbol(p_lsystem, p_state, &p_walk->stack, c);
+		++p_state->index;
+	}
+}
+
+void walk_lindenmayer_box(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_dp_entry **dp, int64_t **lengths, int n, double min_x, double min_y,
+	double max_x, double max_y, lindenmayer_visit_f *visit,
+	lindenmayer_collapse_f *collapse, void *p_data)
+{
+	lindenmayer_box_walk walk;
+	walk.p_lsystem = p_lsystem;
+	walk.dp = dp;
+	walk.lengths = lengths;
+	walk.min_x = min_x;
+	walk.min_y = min_y;
+	walk.max_x = max_x;
+	walk.max_y = max_y;
+	walk.visit = visit;
+	walk.collapse = collapse;
+	walk.p_data = p_data;
+	walk.state.x = walk.state.y = 0;
+	walk.state.heading = 0;
+	memset(walk.state.terms, 0, sizeof(walk.state.terms));
+	walk.state.index = 0;
+	initialize_turtle_stack(&walk.stack);
+	walk_box_rule(&walk, path, n);
+	clear_turtle_stack(&walk.stack);
+}
+
+lindenmayer_dp_entry scan_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, lindenmayer_dp_entry *polls,
+	turtle_stack *stacks, int64_t *starting, int n_polls)
+{
+	lindenmayer_dp_entry ans;
+	turtle_stack stack;
+	initialize_turtle_stack(&stack);
+	initialize_entry(&ans);
+	int i_poll = 0;
+	for (int64_t j = 0; j <= p_path->length; ++j) {
+		// Several chunks can start at the same module
+		while (polls != NULL && i_poll < n_polls && starting[i_poll] == j) {
+			ans.angle = fmod(ans.angle, 2 * PI);
+			if (stacks != NULL) copy_turtle_stack(&stacks[i_poll], &stack);
+			polls[i_poll++] = ans;
+		}
+		if (j == p_path->length) break;
+		char c = p_path->symbols[j];
+		double forward = parametric_forward(p_lsystem, p_path, j);
+		if (forward != 0) {
+			ans.x += forward * cos(ans.angle);
+			ans.y += forward * sin(ans.angle);
+			ans.min_x = min(ans.min_x, ans.x);
+			ans.max_x = max(ans.max_x, ans.x);
+			ans.min_y = min(ans.min_y, ans.y);
+			ans.max_y = max(ans.max_y, ans.y);
+		} else if (c == '[') {
+			push_turtle_state(&stack, ans.x, ans.y, ans.angle);
+		} else if (c == ']') {
+			pop_turtle_state(&stack, &ans.x, &ans.y, &ans.angle);
+		} else {
+			ans.angle += parametric_turn(p_lsystem, p_path, j);
+		}
+	}
+	clear_turtle_stack(&stack);
+	ans.angle = fmod(ans.angle, 2 * PI);
+	return ans;
+}
+
+void partition_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int n_parts, int64_t *starting)
+{
+	double total = 0;
+	for (int64_t j = 0; j < p_path->length; ++j) {
+		total += fabs(parametric_forward(p_lsystem, p_path, j));
+	}
+	// Cut where the distance drawn so far reaches the next share
+	double sum = 0;
+	starting[0] = 0;
+	for (int64_t i = 1, j = 0; i < n_parts; ++i) {
+		while (j < p_path->length && sum < total * i / n_parts) {
+			sum += fabs(parametric_forward(p_lsystem, p_path, j++));
+		}
+		starting[i] = j;
+	}
+	starting[n_parts] = p_path->length;
+}
@@ -2,14 +2,69 @@
 #define LINDENMAYER_DP_H
 
 #include "lindenmayer.h"
+#include "lindenmayer_param.h"
 
+/**
+ *    The drawing of a path as an affine transform of the turtle, which is
+ * moved by (x, y) and then turned by heading times the angle of the system,
+ * together with the box the drawing fits in. Since the headings are whole
+ * numbers of turns, the transforms are composed by looking their rotations
+ * up in the table of the headings of the system. When the system has exact
+ * terms, the move is also kept exactly in terms.
+ *    The box is found from the extents of the drawing in the directions of
+ * the system, which bound its convex hull. The extents of a drawing turned by
+ * a heading are those of the drawing shifted by some directions, so they stay
+ * exact when the drawings are composed, unlike a box whose corners are turned.
+ * Parametric systems only keep the box.
+ */
 typedef struct {
 	char variable;
-	double x, y, angle;
+	double x, y;
+	int64_t heading;
+	int64_t terms[EXACT_MAX_TERMS];
+	double angle; // used instead of heading by parametric systems
 	double min_x, min_y;
 	double max_x, max_y;
+	double extents[MAX_BOUND_DIRECTIONS]; // n_directions of the system are used
 } lindenmayer_dp_entry;
 
+typedef struct {
+	double x, y;
+	int64_t heading;
+	int64_t terms[EXACT_MAX_TERMS];
+	int64_t index; // index in the path of the next symbol, used for coloring
+} lindenmayer_turtle_state;
+
+/**
+ *    The entry, the expanded length and the number of forward steps of every
+ * symbol of a path, found once by scan_varying_path and shared by
+ * partition_by_cost and scan_path. The expansions of the symbols of context
+ * sensitive systems can be kept as well, for join_path_scan.
+ */
+typedef struct {
+	int64_t path_len;
+	lindenmayer_dp_entry *entries;
+	int64_t *lengths;
+	int64_t *forward;
+	char **expansions; // NULL for the symbols that expand to themselves
+} lindenmayer_path_scan;
+
+/**
+ *    Function called for the symbols visited by walk_lindenmayer_box, with the
+ * state of the turtle right before it draws the symbol.
+ */
+typedef void lindenmayer_visit_f(lindenmayer_turtle_state *p_state, void *p_data);
+
+/**
+ *    Function called by walk_lindenmayer_box for the productions that meet
+ * the box, with the state of the turtle right before it draws the production,
+ * the production's bounding box and the number of symbols it expands to.
+ *    @return 1 if the production was drawn at once and is not to be walked,
+ * or 0 otherwise
+ */
+typedef int lindenmayer_collapse_f(lindenmayer_turtle_state *p_state, double min_x,
+	double min_y, double max_x, double max_y, int64_t length, void *p_data);
+
 int compute_no_of_variables(lindenmayer_system *p_lsystem);
 
 /**
@@ -20,19 +75,157 @@ int compute_no_of_variables(lindenmayer_system *p_lsystem);
  *    @polls should be NULL and n_polls should be 0 if you don't want to store
  * additional values. Otherwise, at indices that are in starting a poll will
  * be made.
+ *    @stacks can be NULL. Otherwise, every poll also initializes a stack with
+ * the states saved by the '[' symbols which are still open at its index.
+ *    The rules must have balanced brackets, so expanding a symbol always
+ * leaves the stack as it was.
  */
 lindenmayer_dp_entry scan_rule(lindenmayer_system *p_lsystem, char *rule,
-	lindenmayer_dp_entry *previous_entries, int n_variables, int do_expand,
-	lindenmayer_dp_entry *polls, int *starting, int n_polls);
+	lindenmayer_dp_entry *previous_entries, int do_expand,
+	lindenmayer_dp_entry *polls, turtle_stack *stacks, int *starting, int n_polls);
+
+/**
+ *    Find the entry, the expanded length and the number of forward steps of
+ * every symbol of the given path expanded for n times. Only stochastic and
+ * context sensitive systems are scanned, as every occurrence of their symbols
+ * can expand differently; for the others all the arrays are NULL. The
+ * derivation of every symbol of stochastic systems, at the given nodes (see
+ * expand_lsystem_with_nodes), is walked. nodes can be NULL if the path is the
+ * start of the system. The symbols of context sensitive systems are expanded
+ * with their halo (see expand_with_halo) instead, and their expansions are
+ * kept if keep_expansions is 1, which takes as much memory as the expanded
+ * path.
+ */
+void scan_varying_path(lindenmayer_system *p_lsystem, char *path,
+	uint64_t *nodes, int n, int keep_expansions, lindenmayer_path_scan *p_scan);
+
+/**
+ *    Join the kept expansions of the symbols from begin to end of the scanned
+ * path (see scan_varying_path) and deallocate them, so that they are not
+ * expanded again. The returned string will be allocated and should be
+ * deallocated by the user of this function. Its length is stored in *p_len
+ * if p_len is not NULL.
+ */
+char *join_path_scan(lindenmayer_path_scan *p_scan, char *path, int64_t begin,
+	int64_t end, int64_t *p_len);
+
+/**
+ *    Deallocate the memory used by the given scan of a path.
+ */
+void clear_path_scan(lindenmayer_path_scan *p_scan);
+
+/**
+ *    Same as scan_rule for the given path expanded for n times, using the
+ * given table. The table is not used for stochastic and context sensitive
+ * systems, whose symbols are taken from the given scan of the path (see
+ * scan_varying_path). The scan can be NULL if the path is the start of the
+ * system, in which case it is done here.
+ */
+lindenmayer_dp_entry scan_path(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_path_scan *p_scan, lindenmayer_dp_entry **dp, int n,
+	lindenmayer_dp_entry *polls, turtle_stack *stacks, int *starting, int n_polls);
 
 /**
  *    Return a matrix (n lines and no_of_variables columns) that contains
  * lindenmayer_dp_entries. Each entry represents, if we start to draw at (0, 0)
- * with starting angle = 0, where we will stop drawing and what angle will be
- * facing. Also, determine a tight window (but not the tightes possible) in
- * which we can draw the fractal defined by the lindenmayer system.
+ * with starting heading = 0, where we will stop drawing and what heading will
+ * be facing. Also, determine the window in which we can draw the fractal
+ * defined by the lindenmayer system, which is the tightest possible when its
+ * angle divides the full turn in few enough headings. The column
+ * of a symbol is its rule id minus one.
  */
 lindenmayer_dp_entry **create_lindenmayer_dp_table(
 	lindenmayer_system *p_lsystem, int n);
 
+/**
+ *    Return a matrix (n + 1 lines and 256 columns) in which the entry on line i
+ * and column c is the length of the symbol c expanded for i times.
+ */
+int64_t **create_lindenmayer_length_table(lindenmayer_system *p_lsystem, int n);
+
+/**
+ *    Return a matrix (n + 1 lines and 256 columns) in which the entry on line i
+ * and column c is the number of forward steps the symbol c expanded for i
+ * times draws.
+ */
+int64_t **create_lindenmayer_forward_table(lindenmayer_system *p_lsystem, int n);
+
+/**
+ *    Compute in lengths (256 entries) the length of every symbol expanded for n
+ * times by raising the matrix which counts the symbols of every rule to the
+ * n-th power. This takes O(n_rules^3 * log(n)) steps instead of O(n), and
+ * gives the last line of create_lindenmayer_length_table.
+ */
+void compute_expanded_lengths(lindenmayer_system *p_lsystem, int n,
+	int64_t *lengths);
+
+/**
+ *    Compute in forward (256 entries) the number of forward steps every symbol
+ * expanded for n times draws, the same way as compute_expanded_lengths. This
+ * gives the last line of create_lindenmayer_forward_table.
+ */
+void compute_expanded_forward(lindenmayer_system *p_lsystem, int n,
+	int64_t *forward);
+
+/**
+ *    Split the given path, which will be expanded for n times, in n_parts
+ * chunks that draw about the same number of forward steps. Chunk i starts at
+ * starting[i] in the path and at offsets[i] in the expanded path. Both arrays
+ * need n_parts + 1 entries, the last ones being the lengths of the two paths.
+ * The path must have at least n_parts symbols, as every chunk gets one. The
+ * symbols of stochastic and context sensitive systems are taken from the
+ * given scan of the path, as for scan_path.
+ */
+void partition_by_cost(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_path_scan *p_scan, int n, int n_parts, int *starting, int64_t *offsets);
+
+/**
+ *    Return the state of the turtle right before it draws the symbol at the
+ * given offset of the path expanded for n times, if it starts at (0, 0) with
+ * starting heading = 0. dp and lengths are the tables created for n iterations.
+ * Only the productions on the way to that symbol are entered, so this takes
+ * O(n * rule length) steps. The given empty stack gets the states saved by
+ * the '[' symbols which are still open at the offset.
+ */
+lindenmayer_turtle_state seek_lindenmayer_dp(lindenmayer_system *p_lsystem,
+	char *path, lindenmayer_dp_entry **dp, int64_t **lengths, int n,
+	int64_t offset, turtle_stack *p_stack);
+
+/**
+ *    Walk the given path expanded for n times top-down, as seek_lindenmayer_dp
+ * does, but only enter the productions whose drawing may meet the box from
+ * (min_x, min_y) to (max_x, max_y), using the table to bound them. The turtle
+ * moves over the other ones using the table, so only the derivation near the
+ * box is walked. visit is called with the given data for every forward symbol
+ * reached, which includes all the ones drawn in the box. dp and lengths are
+ * the tables created for n iterations, so the system can not be stochastic or
+ * context sensitive.
+ *    If collapse is not NULL, it is called before entering the productions
+ * that meet the box, and the turtle moves over the ones it draws at once,
+ * like those that fit in a pixel. This bounds the walk by the number of
+ * pixels instead of the length of the path.
+ */
+void walk_lindenmayer_box(lindenmayer_system *p_lsystem, char *path,
+	lindenmayer_dp_entry **dp, int64_t **lengths, int n, double min_x, double min_y,
+	double max_x, double max_y, lindenmayer_visit_f *visit,
+	lindenmayer_collapse_f *collapse, void *p_data);
+
+/**
+ *    Same as scan_rule for a path of a parametric system, which can not use a
+ * table as the modules of a symbol draw differently for every value of their
+ * parameters. A poll is made before the module at every index in starting,
+ * which must not decrease and can be the length of the path.
+ */
+lindenmayer_dp_entry scan_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, lindenmayer_dp_entry *polls,
+	turtle_stack *stacks, int64_t *starting, int n_polls);
+
+/**
+ *    Split the given path of a parametric system in n_parts chunks that draw
+ * about the same distance. Chunk i starts at starting[i], which needs
+ * n_parts + 1 entries, the last one being the length of the path.
+ */
+void partition_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int n_parts, int64_t *starting);
+
 #endif
@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lindenmayer_file.h"
+
+// FNV-1a hash of the given bytes, continuing from the given hash
+static uint64_t hash_bytes(uint64_t hash, void *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= ((uint8_t *)data)[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t hash_lsystem(lindenmayer_system *p_lsystem)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	hash = hash_bytes(hash, p_lsystem->start, strlen(p_lsystem->start) + 1);
+	for (int i = 0; i < 256; ++i) {
+		if (p_lsystem->rules[i] == NULL) continue;
+		uint8_t c = i;
+		hash = hash_bytes(hash, &c, 1);
+		hash = hash_bytes(hash, p_lsystem->rules[i], strlen(p_lsystem->rules[i]) + 1);
+		for (int k = 1; k < p_lsystem->n_productions[i]; ++k) {
+			hash = hash_bytes(hash, p_lsystem->productions[i][k],
+			                  strlen(p_lsystem->productions[i][k]) + 1);
+		}
+		for (int k = 0; k < p_lsystem->n_productions[i]; ++k) {
+			hash = hash_bytes(hash, &p_lsystem->weights[i][k], sizeof(int));
+		}
+	}
+	for (int i = 0; i < 256; ++i) {
+		for (int k = 0; k < p_lsystem->n_context_rules[i]; ++k) {
+			uint8_t c = i;
+			hash = hash_bytes(hash, &c, 1);
+			hash = hash_bytes(hash, &p_lsystem->left_contexts[i][k], 1);
+			hash = hash_bytes(hash, &p_lsystem->right_contexts[i][k], 1);
+			hash = hash_bytes(hash, p_lsystem->context_rules[i][k],
+			                  strlen(p_lsystem->context_rules[i][k]) + 1);
+		}
+	}
+	hash = hash_bytes(hash, &p_lsystem->seed, sizeof(p_lsystem->seed));
+	hash = hash_bytes(hash, p_lsystem->is_forward, sizeof(p_lsystem->is_forward));
+	hash = hash_bytes(hash, &p_lsystem->angle, sizeof(p_lsystem->angle));
+	return hash;
+}
+
+int write_expansion_file(char *file_name, lindenmayer_system *p_lsystem, int n,
+	char *path, int64_t length, lindenmayer_dp_entry *p_info)
+{
+	expansion_file_header header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, EXPANSION_FILE_MAGIC);
+	header.version = EXPANSION_FILE_VERSION;
+	header.n_iterations = n;
+	header.lsystem_hash = hash_lsystem(p_lsystem);
+	header.length = length;
+	header.x = p_info->x;
+	header.y = p_info->y;
+	header.heading = p_info->heading;
+	memcpy(header.terms, p_info->terms, sizeof(header.terms));
+	header.min_x = p_info->min_x;
+	header.min_y = p_info->min_y;
+	header.max_x = p_info->max_x;
+	header.max_y = p_info->max_y;
+
+	// The file is written next to the final one and renamed over it, so that
+	// runs which map the old file keep it and a failed write leaves nothing
+	char *temp_name = malloc(strlen(file_name) + 8);
+	if (temp_name == NULL) {
+		fprintf(stderr, "ERROR: Not enough memory to write expansion file %s.\n", file_name);
+		return LINDENMAYER_ERROR;
+	}
+	sprintf(temp_name, "%s.XXXXXX", file_name);
+	int fd = mkstemp(temp_name);
+	FILE *p_file = fd < 0 ? NULL : fdopen(fd, "wb");
+	if (p_file == NULL) {
+		fprintf(stderr, "ERROR: Could not create expansion file %s.\n", file_name);
+		if (fd >= 0) {
+			close(fd);
+			remove(temp_name);
+		}
+		free(temp_name);
+		return LINDENMAYER_ERROR;
+	}
+	// mkstemp only lets the owner read the file
+	fchmod(fd, 0644);
+	// Write the path together with its terminator
+	int is_written = fwrite(&header, sizeof(header), 1, p_file) == 1 &&
+	                 fwrite(path, sizeof(char), length + 1, p_file) == (size_t)length + 1 &&
+	                 fflush(p_file) == 0 && fsync(fd) == 0;
+	if (fclose(p_file) != 0 || !is_written || rename(temp_name, file_name) != 0) {
+		fprintf(stderr, "ERROR: While writing expansion file %s.\n", file_name);
+		remove(temp_name);
+		free(temp_name);
+		return LINDENMAYER_ERROR;
+	}
+	free(temp_name);
+	return LINDENMAYER_SUCCESS;
+}
+
+int map_expansion_file(expansion_file *p_file, char *file_name,
+	lindenmayer_system *p_lsystem, int n)
+{
+	struct stat file_stat;
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0) return LINDENMAYER_ERROR;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(expansion_file_header)) {
+		close(fd);
+		return LINDENMAYER_ERROR;
+	}
+	p_file->map_size = file_stat.st_size;
+	p_file->p_map = mmap(NULL, p_file->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p_file->p_map == MAP_FAILED) return LINDENMAYER_ERROR;
+
+	// Check that the file holds the expansion we are looking for
+	expansion_file_header *p_header = p_file->p_map;
+	p_file->path = (char *)p_file->p_map + sizeof(expansion_file_header);
+	if (memcmp(p_header->magic, EXPANSION_FILE_MAGIC, sizeof(EXPANSION_FILE_MAGIC)) != 0 ||
+	    p_header->version != EXPANSION_FILE_VERSION ||
+	    p_header->n_iterations != n ||
+	    p_header->lsystem_hash != hash_lsystem(p_lsystem) ||
+	    p_header->length < 0 ||
+	    p_file->map_size != (int64_t)sizeof(expansion_file_header) + p_header->length + 1 ||
+	    p_file->path[p_header->length] != '\0') {
+		munmap(p_file->p_map, p_file->map_size);
+		return LINDENMAYER_ERROR;
+	}
+	p_file->length = p_header->length;
+	p_file->info.x = p_header->x;
+	p_file->info.y = p_header->y;
+	p_file->info.heading = p_header->heading;
+	memcpy(p_file->info.terms, p_header->terms, sizeof(p_file->info.terms));
+	p_file->info.min_x = p_header->min_x;
+	p_file->info.min_y = p_header->min_y;
+	p_file->info.max_x = p_header->max_x;
+	p_file->info.max_y = p_header->max_y;
+	return LINDENMAYER_SUCCESS;
+}
+
+void unmap_expansion_file(expansion_file *p_file)
+{
+	munmap(p_file->p_map, p_file->map_size);
+	p_file->p_map = NULL;
+	p_file->path = NULL;
+}
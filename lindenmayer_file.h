@@ -0,0 +1,68 @@
+#ifndef LINDENMAYER_FILE_H
+#define LINDENMAYER_FILE_H
+
+#include "lindenmayer.h"
+#include "lindenmayer_dp.h"
+
+#define EXPANSION_FILE_MAGIC "LSYSEXP"
+#define EXPANSION_FILE_VERSION 3
+
+/**
+ *    Header of an expansion file. It is followed by the expanded path and its
+ * string terminator. All the fields are stored in the byte order of the
+ * machine that wrote the file.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	int32_t n_iterations;
+	uint64_t lsystem_hash;
+	int64_t length;
+	double x, y;
+	int64_t heading;
+	int64_t terms[EXACT_MAX_TERMS];
+	double min_x, min_y;
+	double max_x, max_y;
+} expansion_file_header;
+
+typedef struct {
+	void *p_map;
+	int64_t map_size;
+	char *path;
+	int64_t length;
+	lindenmayer_dp_entry info;
+} expansion_file;
+
+/**
+ *    Hash everything that changes the expansion or the drawing of the given
+ * lindenmayer system, which expansion files are checked against.
+ *    @return the hash
+ */
+uint64_t hash_lsystem(lindenmayer_system *p_lsystem);
+
+/**
+ *    Write the given path (the lindenmayer system expanded for n times) and
+ * the information about it found using dynamic programming in a file that
+ * later runs can map. An existing file is only replaced once the new one is
+ * complete, so the runs that map it are not disturbed.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR otherwise
+ */
+int write_expansion_file(char *file_name, lindenmayer_system *p_lsystem, int n,
+	char *path, int64_t length, lindenmayer_dp_entry *p_info);
+
+/**
+ *    Map the given expansion file read-only. The path is used in place so it
+ * must not be changed and is valid until the file is unmapped.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR if the file
+ * does not exist, is not valid or was not written for the given lindenmayer
+ * system expanded for n times
+ */
+int map_expansion_file(expansion_file *p_file, char *file_name,
+	lindenmayer_system *p_lsystem, int n);
+
+/**
+ *    Unmap the given expansion file. Its path should no longer be used.
+ */
+void unmap_expansion_file(expansion_file *p_file);
+
+#endif
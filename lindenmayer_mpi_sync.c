@@ -13,6 +13,16 @@
 // Decomment to not write the image
 // #define DONT_WRITE_IMAGE
 
+// Decomment to draw the image right into this file instead of writing it
+// #define IMAGE_FILE "lindenmayer.ppm"
+
+// Decomment to keep the pixels of the image in tiles, which is faster to
+// draw on when the image is large
+// #define TILED_IMAGE
+
+// Decomment to walk the expansion lazily instead of building the whole path
+// #define STREAM_EXPANSION
+
 #pragma pack(1)
 typedef struct {
 	pixel_t color;
@@ -20,25 +30,34 @@ typedef struct {
 } mpi_pixel_t;
 #pragma pack()
 
-void expand_and_send_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, char *path,
-               double start_x, double start_y, double start_angle, int scale,
-               int previous_length, int total_length, coloring_f coloring_f)
+void expand_and_send_path(pixmap_t *p_pixmap, lindenmayer_stream *p_stream,
+               turtle_stack *p_stack, turtle *p_turtle, int scale,
+               int64_t previous_length, int64_t total_length, coloring_f coloring_f)
 {
-	double x = start_x;
-	double y = start_y;
-	double angle = start_angle;
 	mpi_pixel_t mpi_pixel;
-	double a = x - (int)x;
-	double b = y - (int)y;
-	mpi_pixel.x = a <= 0.5 ? (int)x : (int)x + 1;
-	mpi_pixel.y = b <= 0.5 ? (int)y : (int)y + 1;
-	mpi_pixel.color = coloring_f(previous_length, total_length);
-	MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->is_forward[(int)path[i]]) {
+	// The start of every other chunk is sent by the chunk before it
+	if (previous_length == 0) {
+		double x = p_turtle->x;
+		double y = p_turtle->y;
+		double a = x - (int)x;
+		double b = y - (int)y;
+		mpi_pixel.x = a <= 0.5 ? (int)x : (int)x + 1;
+		mpi_pixel.y = b <= 0.5 ? (int)y : (int)y + 1;
+		mpi_pixel.color = coloring_f(0, total_length);
+		MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+	}
+	turtle_op_stream ops;
+	turtle_op op;
+	initialize_turtle_op_stream(&ops, p_stream);
+	while (next_turtle_op(&ops, &op)) {
+		if (op.branch > 0) push_turtle(p_stack, p_turtle);
+		else if (op.branch < 0) pop_turtle(p_stack, p_turtle);
+		turn_turtle(p_turtle, op.turn);
+		for (int64_t i = op.index; i < op.index + op.forward; ++i) {
 			for (int j = 0; j < scale; ++j) {
-				x += cos(angle);
-				y += sin(angle);
+				step_turtle(p_turtle);
+				double x = p_turtle->x;
+				double y = p_turtle->y;
 				double a = x - (int)x;
 				double b = y - (int)y;
 				mpi_pixel.x = a <= 0.5 ? (int)x : (int)x + 1;
@@ -47,10 +66,6 @@ void expand_and_send_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, cha
 				MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
 				// color_point(p_pixmap, x, y, pixel, blend_lighten);
 			}
-		} else if (path[i] == '+') {
-				angle += p_lsystem->angle;
-		} else if (path[i] == '-') {
-				angle -= p_lsystem->angle;
 		}
 	}
 	// Signal end
@@ -59,6 +74,139 @@ void expand_and_send_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, cha
 	MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
 }
 
+void send_parametric_path(lindenmayer_parametric_system *p_lsystem,
+               lindenmayer_parametric_path *p_path, turtle_stack *p_stack, int64_t begin,
+               int64_t end, double start_x, double start_y, double start_angle, int scale,
+               coloring_f coloring_f)
+{
+	mpi_pixel_t mpi_pixel;
+	double x = start_x;
+	double y = start_y;
+	double angle = start_angle;
+
+	// The start of every other chunk is sent by the chunk before it
+	if (begin == 0) {
+		double a = x - (int)x;
+		double b = y - (int)y;
+		mpi_pixel.x = a <= 0.5 ? (int)x : (int)x + 1;
+		mpi_pixel.y = b <= 0.5 ? (int)y : (int)y + 1;
+		mpi_pixel.color = coloring_f(0, p_path->length);
+		MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+	}
+	for (int64_t i = begin; i < end; ++i) {
+		char c = p_path->symbols[i];
+		double forward = parametric_forward(p_lsystem, p_path, i) * scale;
+		if (forward != 0) {
+			// Move by steps of about a pixel, like the other systems do
+			int n_steps = ceil(fabs(forward));
+			double dx = forward * cos(angle) / n_steps;
+			double dy = forward * sin(angle) / n_steps;
+			mpi_pixel.color = coloring_f(i, p_path->length);
+			for (int j = 0; j < n_steps; ++j) {
+				x += dx;
+				y += dy;
+				double a = x - (int)x;
+				double b = y - (int)y;
+				mpi_pixel.x = a <= 0.5 ? (int)x : (int)x + 1;
+				mpi_pixel.y = b <= 0.5 ? (int)y : (int)y + 1;
+				MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+			}
+		} else if (c == '[') {
+			push_turtle_state(p_stack, x, y, angle);
+		} else if (c == ']') {
+			pop_turtle_state(p_stack, &x, &y, &angle);
+		} else {
+			angle += parametric_turn(p_lsystem, p_path, i);
+		}
+	}
+	// Signal end
+	mpi_pixel.x = -1;
+	mpi_pixel.y = -1;
+	MPI_Send(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+}
+
+// Parametric systems have their own paths, which every rank expands and
+// scans, then every rank but 0 draws its own chunk
+int run_parametric_system(int world_rank, int world_size, int n_iterations, int scale,
+	coloring_f *p_coloring)
+{
+	pixmap_t img;
+	lindenmayer_parametric_system lsystem;
+	lindenmayer_parametric_path path;
+	initialize_parametric_tree(&lsystem);
+	initialize_parametric_path(&path, &lsystem);
+	expand_parametric_system(&lsystem, n_iterations, &path);
+	int n_threads = world_size - 1;
+	int64_t *starting = malloc((n_threads + 1) * sizeof(int64_t));
+	lindenmayer_dp_entry *entries = malloc(n_threads * sizeof(lindenmayer_dp_entry));
+	turtle_stack *stacks = malloc(n_threads * sizeof(turtle_stack));
+	partition_parametric_path(&lsystem, &path, n_threads, starting);
+	lindenmayer_dp_entry info = scan_parametric_path(&lsystem, &path, entries, stacks,
+		starting, n_threads);
+
+	// Initialize pixmap_t
+	int height = (info.max_x - info.min_x + 10) * scale;
+	int width = (info.max_y - info.min_y + 10) * scale;
+
+	int pixmap_status = PIXMAP_SUCCESS;
+	if (world_rank == 0) {
+#ifdef IMAGE_FILE
+		pixmap_status = initialize_file_backed_pixmap(&img, width, height, IMAGE_FILE);
+#elif defined(TILED_IMAGE)
+		pixmap_status = initialize_tiled_pixmap(&img, width, height);
+#else
+		pixmap_status = initialize_pixmap(&img, width, height);
+#endif
+	}
+	// The other ranks stop as well if the image can not be allocated, instead
+	// of waiting for rank 0 to receive their pixels
+	MPI_Bcast(&pixmap_status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (pixmap_status != PIXMAP_SUCCESS) {
+		free(starting);
+		free(entries);
+		for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_parametric_path(&path);
+		clear_parametric_system(&lsystem);
+		return -1;
+	}
+
+	// Draw fractal
+	if (world_rank == 0) {
+		int have_finished = 0;
+		MPI_Status status;
+		while (have_finished < world_size - 1) {
+			mpi_pixel_t mpi_pixel;
+			MPI_Recv(&mpi_pixel, sizeof(mpi_pixel_t), MPI_BYTE, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
+			if (mpi_pixel.x == -1 && mpi_pixel.y == -1) ++have_finished;
+			else color_point(&img, mpi_pixel.x, mpi_pixel.y, mpi_pixel.color, blend_lighten);
+		}
+	} else {
+		transform_turtle_stack(&stacks[world_rank - 1], -info.min_x + 5, -info.min_y + 5, scale);
+		lindenmayer_dp_entry *p_entry = &entries[world_rank - 1];
+		send_parametric_path(&lsystem, &path, &stacks[world_rank - 1], starting[world_rank - 1],
+		  starting[world_rank], (-info.min_x + p_entry->x + 5) * scale,
+		  (-info.min_y + p_entry->y + 5) * scale, p_entry->angle, scale, p_coloring);
+	}
+
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
+	if (world_rank == 0) {
+		write_pixmap(&img, stdout);
+	}
+#endif
+	// Free the used memory
+	free(starting);
+	free(entries);
+	for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
+	clear_parametric_path(&path);
+	clear_parametric_system(&lsystem);
+	if (world_rank == 0) {
+		clear_pixmap(&img);
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	MPI_Init(&argc, &argv);
@@ -75,6 +223,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "   3 = Quadratic Gosper\n");
 		fprintf(stderr, "   4 = Levy Curve\n");
 		fprintf(stderr, "   5 = Pentaplexity\n");
+		fprintf(stderr, "   6 = Fractal Plant\n");
+		fprintf(stderr, "   7 = Stochastic Plant\n");
+		fprintf(stderr, "   8 = Parametric Tree\n");
+		fprintf(stderr, "   9 = Context Koch Curve\n");
 		fprintf(stderr, "Coloring type is:\n");
 		fprintf(stderr, "   0 = HSV coloring\n");
 		fprintf(stderr, "   1 = Christmas coloring\n");
@@ -84,6 +236,14 @@ int main(int argc, char *argv[])
 	lindenmayer_system lsystem;
 	coloring_f *p_coloring;
 
+	if (atoi(argv[1]) == 8) {
+		p_coloring = atoi(argv[4]) == 1 ? christmas_coloring : hsv_coloring;
+		int status = run_parametric_system(world_rank, world_size, atoi(argv[2]),
+			atoi(argv[3]), p_coloring);
+		MPI_Finalize();
+		return status;
+	}
+
 	// Chose the curve type
 	switch (atoi(argv[1])) {
 		case 0:
@@ -104,9 +264,20 @@ int main(int argc, char *argv[])
 		case 5:
 			initialize_pentaplexity(&lsystem);
 			break;
+		case 6:
+			initialize_fractal_plant(&lsystem);
+			break;
+		case 7:
+			initialize_stochastic_plant(&lsystem);
+			break;
+		case 9:
+			initialize_context_koch_curve(&lsystem);
+			break;
 		default:
 			initialize_dragon_curve(&lsystem);
 	}
+	// The symbols that are never drawn only make the paths longer
+	eliminate_dead_symbols(&lsystem);
 	// Choose the coloring type
 	if (atoi(argv[4]) == 1) p_coloring = christmas_coloring;
 	else p_coloring = hsv_coloring;
@@ -116,23 +287,53 @@ int main(int argc, char *argv[])
 	int n_iterations = atoi(argv[2]);
 	int scale = atoi(argv[3]);
 	lindenmayer_dp_entry **dp = create_lindenmayer_dp_table(&lsystem, n_iterations);
-	char *initially_expanded_path = expand_lsystem(&lsystem, INITIAL_EXPANDS);
-	int initially_expanded_path_len = strlen(initially_expanded_path);
-	int *starting = malloc(n_threads * sizeof(int));
+	uint64_t *nodes;
+	char *initially_expanded_path = expand_lsystem_with_nodes(&lsystem, INITIAL_EXPANDS, &nodes);
+	int *starting = malloc((n_threads + 1) * sizeof(int));
+	int64_t *offsets = malloc((n_threads + 1) * sizeof(int64_t));
 	lindenmayer_dp_entry *entries = malloc(n_threads * sizeof(lindenmayer_dp_entry));
-	for (int i = 0; i < n_threads; ++i) {
-		starting[i] = i * initially_expanded_path_len / n_threads;
-	}
-	lindenmayer_dp_entry info = scan_rule(&lsystem, initially_expanded_path,
-		dp[n_iterations - INITIAL_EXPANDS], compute_no_of_variables(&lsystem), 1,
-		entries, starting, n_threads);
+	turtle_stack *stacks = malloc(n_threads * sizeof(turtle_stack));
+	lindenmayer_path_scan scan;
+	// Every rank scans the whole path, so the expansions are not kept, which
+	// would hold the whole expanded path on every rank
+	scan_varying_path(&lsystem, initially_expanded_path, nodes, n_iterations - INITIAL_EXPANDS,
+	                  0, &scan);
+	partition_by_cost(&lsystem, initially_expanded_path, &scan, n_iterations - INITIAL_EXPANDS,
+	                  n_threads, starting, offsets);
+	lindenmayer_dp_entry info = scan_path(&lsystem, initially_expanded_path, &scan,
+		dp, n_iterations - INITIAL_EXPANDS, entries, stacks, starting, n_threads);
+	clear_path_scan(&scan);
 
 	// Initialize pixmap_t
 	int height = (info.max_x - info.min_x + 10) * scale;
 	int width = (info.max_y - info.min_y + 10) * scale;
 
+	int pixmap_status = PIXMAP_SUCCESS;
 	if (world_rank == 0) {
-		initialize_pixmap(&img, width, height);
+#ifdef IMAGE_FILE
+		pixmap_status = initialize_file_backed_pixmap(&img, width, height, IMAGE_FILE);
+#elif defined(TILED_IMAGE)
+		pixmap_status = initialize_tiled_pixmap(&img, width, height);
+#else
+		pixmap_status = initialize_pixmap(&img, width, height);
+#endif
+	}
+	// The other ranks stop as well if the image can not be allocated, instead
+	// of waiting for rank 0 to receive their pixels
+	MPI_Bcast(&pixmap_status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (pixmap_status != PIXMAP_SUCCESS) {
+		for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
+		free(dp);
+		free(starting);
+		free(offsets);
+		free(initially_expanded_path);
+		free(nodes);
+		free(entries);
+		for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_lsystem(&lsystem);
+		MPI_Finalize();
+		return -1;
 	}
 
 	// Draw fractal
@@ -147,25 +348,47 @@ int main(int argc, char *argv[])
 		}
 	} else {
 		// Expand the string
-		int end = world_rank * initially_expanded_path_len / (world_size - 1);
-		int len = end - starting[world_rank - 1];
-		char *path = malloc((len + 1) * sizeof(char));
-		memcpy(path, initially_expanded_path + starting[world_rank - 1], len);
-		path[len] = '\0';
-		for (int j = 0; j < n_iterations - INITIAL_EXPANDS; ++j) {
-			char *tmp = path;
-			path = expand_path(&lsystem, tmp);
-			free(tmp);
+		int len = starting[world_rank] - starting[world_rank - 1];
+		char *chunk = initially_expanded_path + starting[world_rank - 1];
+		uint64_t *chunk_nodes = nodes == NULL ? NULL : nodes + starting[world_rank - 1];
+		lindenmayer_arena arena;
+		char *halo_path = NULL;
+		lindenmayer_stream stream;
+		// Only streams follow the derivation of stochastic systems
+		int use_stream = lsystem.is_stochastic;
+#ifdef STREAM_EXPANSION
+		use_stream = 1;
+#endif
+		if (lsystem.is_context_sensitive) {
+			// The symbols around the chunk are read as its context
+			halo_path = expand_with_halo(&lsystem, initially_expanded_path,
+				starting[n_threads], starting[world_rank - 1], starting[world_rank - 1] + len,
+				n_iterations - INITIAL_EXPANDS, NULL);
+			initialize_lsystem_stream(&stream, &lsystem, halo_path, 0);
+		} else if (use_stream) {
+			// Only copy the chunk, the stream expands it
+			initialize_arena(&arena, &lsystem, chunk, len, 0);
+			char *path = expand_in_arena(&lsystem, &arena, chunk, len, 0);
+			initialize_derivation_stream(&stream, &lsystem, path, chunk_nodes,
+			                             n_iterations - INITIAL_EXPANDS);
+		} else {
+			initialize_arena(&arena, &lsystem, chunk, len, n_iterations - INITIAL_EXPANDS);
+			char *path = expand_in_arena(&lsystem, &arena, chunk, len, n_iterations - INITIAL_EXPANDS);
+			initialize_lsystem_stream(&stream, &lsystem, path, 0);
 		}
-		expand_and_send_path(&img, &lsystem, path,
-		  (-info.min_x + entries[world_rank - 1].x + 5) * scale,
-		  (-info.min_y + entries[world_rank - 1].y + 5) * scale,
-		  entries[world_rank - 1].angle, scale,
-		  (world_rank - 1) * strlen(path), strlen(path) * n_threads, p_coloring);
-		free(path);
+		transform_turtle_stack(&stacks[world_rank - 1], -info.min_x + 5, -info.min_y + 5, scale);
+		lindenmayer_dp_entry *p_entry = &entries[world_rank - 1];
+		turtle turtle;
+		place_turtle(&turtle, &lsystem, (-info.min_x + 5) * scale, (-info.min_y + 5) * scale,
+		  scale, p_entry->x, p_entry->y, p_entry->terms, p_entry->heading);
+		expand_and_send_path(&img, &stream, &stacks[world_rank - 1], &turtle, scale,
+		  offsets[world_rank - 1], offsets[n_threads], p_coloring);
+		clear_lsystem_stream(&stream);
+		if (halo_path != NULL) free(halo_path);
+		else clear_arena(&arena);
 	}
 
-#ifndef DONT_WRITE_IMAGE
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
 	if (world_rank == 0) {
 		write_pixmap(&img, stdout);
 	}
@@ -174,8 +397,12 @@ int main(int argc, char *argv[])
 	for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
 	free(dp);
 	free(starting);
+	free(offsets);
 	free(initially_expanded_path);
+	free(nodes);
 	free(entries);
+	for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
 	clear_lsystem(&lsystem);
 	if (world_rank == 0) {
 		clear_pixmap(&img);
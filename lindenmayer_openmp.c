@@ -6,6 +6,7 @@
 
 #include "lindenmayer.h"
 #include "lindenmayer_dp.h"
+#include "lindenmayer_param.h"
 #include "pixmap.h"
 
 #define INITIAL_EXPANDS 3
@@ -14,29 +15,163 @@
 // Decomment to not write the image
 // #define DONT_WRITE_IMAGE
 
-void draw_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, char *path,
-               double start_x, double start_y, double start_angle, int scale,
-               int previous_length, int total_length, coloring_f coloring_f)
+// Decomment to draw the image right into this file instead of writing it
+// #define IMAGE_FILE "lindenmayer.ppm"
+
+// Decomment to keep the pixels of the image in tiles, which is faster to
+// draw on when the image is large
+// #define TILED_IMAGE
+
+// Decomment to walk the expansion lazily instead of building the whole path
+// #define STREAM_EXPANSION
+
+// Decomment to split the final path in equal chunks, seeking the state of the
+// turtle at the start of each chunk instead of using the initial expansions
+// #define SEEK_SPLIT
+
+void draw_path(pixmap_t *p_pixmap, lindenmayer_stream *p_stream, turtle_stack *p_stack,
+               turtle *p_turtle, int scale, int64_t previous_length, int64_t total_length,
+               coloring_f coloring_f)
+{
+	// The start of every other chunk is drawn by the chunk before it
+	if (previous_length == 0) {
+		color_point(p_pixmap, p_turtle->x, p_turtle->y, coloring_f(0, total_length),
+		            blend_lighten);
+	}
+	turtle_op_stream ops;
+	turtle_op op;
+	initialize_turtle_op_stream(&ops, p_stream);
+	while (next_turtle_op(&ops, &op)) {
+		if (op.branch > 0) push_turtle(p_stack, p_turtle);
+		else if (op.branch < 0) pop_turtle(p_stack, p_turtle);
+		turn_turtle(p_turtle, op.turn);
+		for (int64_t i = op.index; i < op.index + op.forward; ++i) {
+			for (int j = 0; j < scale; ++j) {
+				step_turtle(p_turtle);
+				pixel_t pixel = coloring_f(previous_length + i, total_length);
+				color_point(p_pixmap, p_turtle->x, p_turtle->y, pixel, blend_lighten);
+			}
+		}
+	}
+}
+
+void draw_parametric_path(pixmap_t *p_pixmap, lindenmayer_parametric_system *p_lsystem,
+                          lindenmayer_parametric_path *p_path, turtle_stack *p_stack,
+                          int64_t begin, int64_t end, double start_x, double start_y,
+                          double start_angle, int scale, coloring_f coloring_f)
 {
 	double x = start_x;
 	double y = start_y;
 	double angle = start_angle;
 
-	color_point(p_pixmap, x, y, coloring_f(previous_length, total_length), blend_lighten);
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->is_forward[(int)path[i]]) {
-			for (int j = 0; j < scale; ++j) {
-				x += cos(angle);
-				y += sin(angle);
-				pixel_t pixel = coloring_f(previous_length + i, total_length);
+	// The start of every other chunk is drawn by the chunk before it
+	if (begin == 0) color_point(p_pixmap, x, y, coloring_f(0, p_path->length), blend_lighten);
+	for (int64_t i = begin; i < end; ++i) {
+		char c = p_path->symbols[i];
+		double forward = parametric_forward(p_lsystem, p_path, i) * scale;
+		if (forward != 0) {
+			// Move by steps of about a pixel, like the other systems do
+			int n_steps = ceil(fabs(forward));
+			double dx = forward * cos(angle) / n_steps;
+			double dy = forward * sin(angle) / n_steps;
+			pixel_t pixel = coloring_f(i, p_path->length);
+			for (int j = 0; j < n_steps; ++j) {
+				x += dx;
+				y += dy;
 				color_point(p_pixmap, x, y, pixel, blend_lighten);
 			}
-		} else if (path[i] == '+') {
-				angle += p_lsystem->angle;
-		} else if (path[i] == '-') {
-				angle -= p_lsystem->angle;
+		} else if (c == '[') {
+			push_turtle_state(p_stack, x, y, angle);
+		} else if (c == ']') {
+			pop_turtle_state(p_stack, &x, &y, &angle);
+		} else {
+			angle += parametric_turn(p_lsystem, p_path, i);
+		}
+	}
+}
+
+// Initialize the image and the n_layers layers the threads draw on, or nothing
+// if any of them can not be allocated
+int initialize_pixmaps(pixmap_t *p_img, pixmap_t *layers, int n_layers, int width,
+	int height)
+{
+#ifdef IMAGE_FILE
+	if (initialize_file_backed_pixmap(p_img, width, height, IMAGE_FILE) != PIXMAP_SUCCESS) {
+#elif defined(TILED_IMAGE)
+	if (initialize_tiled_pixmap(p_img, width, height) != PIXMAP_SUCCESS) {
+#else
+	if (initialize_pixmap(p_img, width, height) != PIXMAP_SUCCESS) {
+#endif
+		return PIXMAP_ERROR;
+	}
+	// Only the tiles drawn on are allocated
+	for (int i = 0; i < n_layers; ++i) {
+		if (initialize_tiled_pixmap(&layers[i], width, height) != PIXMAP_SUCCESS) {
+			while (i > 0) clear_pixmap(&layers[--i]);
+			clear_pixmap(p_img);
+			return PIXMAP_ERROR;
 		}
 	}
+	return PIXMAP_SUCCESS;
+}
+
+// Parametric systems have their own paths, which are split between the
+// threads by the distance they draw
+int run_parametric_system(int n_iterations, int scale, coloring_f *p_coloring)
+{
+	pixmap_t img;
+	lindenmayer_parametric_system lsystem;
+	lindenmayer_parametric_path path;
+	initialize_parametric_tree(&lsystem);
+	initialize_parametric_path(&path, &lsystem);
+	expand_parametric_system(&lsystem, n_iterations, &path);
+	int64_t *starting = malloc((NUM_THREADS + 1) * sizeof(int64_t));
+	lindenmayer_dp_entry *entries = malloc(NUM_THREADS * sizeof(lindenmayer_dp_entry));
+	turtle_stack *stacks = malloc(NUM_THREADS * sizeof(turtle_stack));
+	partition_parametric_path(&lsystem, &path, NUM_THREADS, starting);
+	lindenmayer_dp_entry info = scan_parametric_path(&lsystem, &path, entries, stacks,
+		starting, NUM_THREADS);
+
+	// Draw fractal
+	int height = (info.max_x - info.min_x + 10) * scale;
+	int width = (info.max_y - info.min_y + 10) * scale;
+	// Every thread draws on its own layer so that they do not race for the
+	// pixels, then the layers are blended
+	pixmap_t layers[NUM_THREADS];
+	if (initialize_pixmaps(&img, layers, NUM_THREADS, width, height) != PIXMAP_SUCCESS) {
+		free(starting);
+		free(entries);
+		for (int i = 0; i < NUM_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_parametric_path(&path);
+		clear_parametric_system(&lsystem);
+		return -1;
+	}
+	#pragma omp parallel num_threads(NUM_THREADS)
+	{
+		int i = omp_get_thread_num();
+		transform_turtle_stack(&stacks[i], -info.min_x + 5, -info.min_y + 5, scale);
+		draw_parametric_path(&layers[i], &lsystem, &path, &stacks[i], starting[i], starting[i + 1],
+			(-info.min_x + entries[i].x + 5) * scale, (-info.min_y + entries[i].y + 5) * scale,
+			entries[i].angle, scale, p_coloring);
+		#pragma omp barrier
+		merge_pixmaps(&img, layers, NUM_THREADS, i, NUM_THREADS, blend_lighten);
+	}
+	for (int i = 0; i < NUM_THREADS; ++i) clear_pixmap(&layers[i]);
+
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
+	write_pixmap(&img, stdout);
+#endif
+
+	// Free the used memory
+	free(starting);
+	free(entries);
+	for (int i = 0; i < NUM_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
+	clear_parametric_path(&path);
+	clear_parametric_system(&lsystem);
+	clear_pixmap(&img);
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -50,6 +185,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "   3 = Quadratic Gosper\n");
 		fprintf(stderr, "   4 = Levy Curve\n");
 		fprintf(stderr, "   5 = Pentaplexity\n");
+		fprintf(stderr, "   6 = Fractal Plant\n");
+		fprintf(stderr, "   7 = Stochastic Plant\n");
+		fprintf(stderr, "   8 = Parametric Tree\n");
+		fprintf(stderr, "   9 = Context Koch Curve\n");
 		fprintf(stderr, "Coloring type is:\n");
 		fprintf(stderr, "   0 = HSV coloring\n");
 		fprintf(stderr, "   1 = Christmas coloring\n");
@@ -59,6 +198,11 @@ int main(int argc, char *argv[])
 	lindenmayer_system lsystem;
 	coloring_f *p_coloring;
 
+	if (atoi(argv[1]) == 8) {
+		p_coloring = atoi(argv[4]) == 1 ? christmas_coloring : hsv_coloring;
+		return run_parametric_system(atoi(argv[2]), atoi(argv[3]), p_coloring);
+	}
+
 	// Chose the curve type
 	switch (atoi(argv[1])) {
 		case 0:
@@ -79,9 +223,20 @@ int main(int argc, char *argv[])
 		case 5:
 			initialize_pentaplexity(&lsystem);
 			break;
+		case 6:
+			initialize_fractal_plant(&lsystem);
+			break;
+		case 7:
+			initialize_stochastic_plant(&lsystem);
+			break;
+		case 9:
+			initialize_context_koch_curve(&lsystem);
+			break;
 		default:
 			initialize_dragon_curve(&lsystem);
 	}
+	// The symbols that are never drawn only make the paths longer
+	eliminate_dead_symbols(&lsystem);
 	// Choose the coloring type
 	if (atoi(argv[4]) == 1) p_coloring = christmas_coloring;
 	else p_coloring = hsv_coloring;
@@ -90,54 +245,146 @@ int main(int argc, char *argv[])
 	int n_iterations = atoi(argv[2]);
 	int scale = atoi(argv[3]);
 	lindenmayer_dp_entry **dp = create_lindenmayer_dp_table(&lsystem, n_iterations);
-	char *initially_expanded_path = expand_lsystem(&lsystem, INITIAL_EXPANDS);
-	int initially_expanded_path_len = strlen(initially_expanded_path);
-	int *starting = malloc(NUM_THREADS * sizeof(int));
-	lindenmayer_dp_entry *entries = malloc(NUM_THREADS * sizeof(lindenmayer_dp_entry));
-	for (int i = 0; i < NUM_THREADS; ++i) {
-		starting[i] = i * initially_expanded_path_len / NUM_THREADS;
+#ifdef SEEK_SPLIT
+	if (lsystem.is_stochastic || lsystem.is_context_sensitive) {
+		fprintf(stderr, "ERROR: Seeking only works for deterministic context free systems.\n");
+		return -1;
+	}
+	int64_t **lengths = create_lindenmayer_length_table(&lsystem, n_iterations);
+	int64_t total_length = 0;
+	for (int i = 0; lsystem.start[i] != '\0'; ++i) {
+		total_length += lengths[n_iterations][(uint8_t)lsystem.start[i]];
 	}
-	lindenmayer_dp_entry info = scan_rule(&lsystem, initially_expanded_path,
-		dp[n_iterations - INITIAL_EXPANDS], compute_no_of_variables(&lsystem), 1,
-		entries, starting, NUM_THREADS);
+	lindenmayer_dp_entry info = scan_rule(&lsystem, lsystem.start, dp[n_iterations], 1,
+		NULL, NULL, NULL, 0);
+#else
+	uint64_t *nodes;
+	char *initially_expanded_path = expand_lsystem_with_nodes(&lsystem, INITIAL_EXPANDS, &nodes);
+	int *starting = malloc((NUM_THREADS + 1) * sizeof(int));
+	int64_t *offsets = malloc((NUM_THREADS + 1) * sizeof(int64_t));
+	lindenmayer_dp_entry *entries = malloc(NUM_THREADS * sizeof(lindenmayer_dp_entry));
+	turtle_stack *stacks = malloc(NUM_THREADS * sizeof(turtle_stack));
+	lindenmayer_path_scan scan;
+	scan_varying_path(&lsystem, initially_expanded_path, nodes, n_iterations - INITIAL_EXPANDS,
+	                  1, &scan);
+	partition_by_cost(&lsystem, initially_expanded_path, &scan, n_iterations - INITIAL_EXPANDS,
+	                  NUM_THREADS, starting, offsets);
+	lindenmayer_dp_entry info = scan_path(&lsystem, initially_expanded_path, &scan,
+		dp, n_iterations - INITIAL_EXPANDS, entries, stacks, starting, NUM_THREADS);
+#endif
 
 	// Initialize pixmap_t
 	int height = (info.max_x - info.min_x + 10) * scale;
 	int width = (info.max_y - info.min_y + 10) * scale;
-	initialize_pixmap(&img, width, height);
+	pixmap_t layers[NUM_THREADS];
+	if (initialize_pixmaps(&img, layers, NUM_THREADS, width, height) != PIXMAP_SUCCESS) {
+		for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
+		free(dp);
+#ifdef SEEK_SPLIT
+		for (int i = 0; i <= n_iterations; ++i) free(lengths[i]);
+		free(lengths);
+#else
+		free(starting);
+		free(offsets);
+		free(initially_expanded_path);
+		free(nodes);
+		free(entries);
+		for (int i = 0; i < NUM_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_path_scan(&scan);
+#endif
+		clear_lsystem(&lsystem);
+		return -1;
+	}
 
-	// Draw fractal
+	// Draw fractal, every thread on its own layer so that they do not race for
+	// the pixels, then blend the layers
 	#pragma omp parallel num_threads(NUM_THREADS)
 	{
 		int i = omp_get_thread_num();
+		lindenmayer_stream stream;
+#ifdef SEEK_SPLIT
+		// Walk only this chunk of the final path
+		int64_t begin = i * total_length / NUM_THREADS;
+		int64_t end = (i + 1) * total_length / NUM_THREADS;
+		turtle_stack stack;
+		initialize_turtle_stack(&stack);
+		lindenmayer_turtle_state state = seek_lindenmayer_dp(&lsystem, lsystem.start,
+			dp, lengths, n_iterations, begin, &stack);
+		transform_turtle_stack(&stack, -info.min_x + 5, -info.min_y + 5, scale);
+		initialize_lsystem_stream(&stream, &lsystem, lsystem.start, n_iterations);
+		seek_lsystem_stream(&stream, begin, end - begin);
+		turtle turtle;
+		place_turtle(&turtle, &lsystem, (-info.min_x + 5) * scale, (-info.min_y + 5) * scale,
+			scale, state.x, state.y, state.terms, state.heading);
+		draw_path(&layers[i], &stream, &stack, &turtle, scale, state.index, total_length,
+			p_coloring);
+		clear_turtle_stack(&stack);
+		clear_lsystem_stream(&stream);
+#else
 		// Expand the string
-		int end = (i + 1) * initially_expanded_path_len / NUM_THREADS;
-		int len = end - starting[i];
-		char *path = malloc((len + 1) * sizeof(char));
-		memcpy(path, initially_expanded_path + starting[i], len);
-		path[len] = '\0';
-		for (int j = 0; j < n_iterations - INITIAL_EXPANDS; ++j) {
-			char *tmp = path;
-			path = expand_path(&lsystem, tmp);
-			free(tmp);
+		int len = starting[i + 1] - starting[i];
+		char *chunk = initially_expanded_path + starting[i];
+		uint64_t *chunk_nodes = nodes == NULL ? NULL : nodes + starting[i];
+		lindenmayer_arena arena;
+		char *halo_path = NULL;
+		// Only streams follow the derivation of stochastic systems
+		int use_stream = lsystem.is_stochastic;
+#ifdef STREAM_EXPANSION
+		use_stream = 1;
+#endif
+		if (lsystem.is_context_sensitive) {
+			// The scan kept the expansions of the symbols, which saw their context
+			halo_path = join_path_scan(&scan, initially_expanded_path, starting[i],
+				starting[i] + len, NULL);
+			initialize_lsystem_stream(&stream, &lsystem, halo_path, 0);
+		} else if (use_stream) {
+			// Only copy the chunk, the stream expands it
+			initialize_arena(&arena, &lsystem, chunk, len, 0);
+			char *path = expand_in_arena(&lsystem, &arena, chunk, len, 0);
+			initialize_derivation_stream(&stream, &lsystem, path, chunk_nodes,
+			                             n_iterations - INITIAL_EXPANDS);
+		} else {
+			initialize_arena(&arena, &lsystem, chunk, len, n_iterations - INITIAL_EXPANDS);
+			char *path = expand_in_arena(&lsystem, &arena, chunk, len, n_iterations - INITIAL_EXPANDS);
+			initialize_lsystem_stream(&stream, &lsystem, path, 0);
 		}
 		// Draw the lines
-		draw_path(&img, &lsystem, path, (-info.min_x + entries[i].x + 5) * scale,
-			(-info.min_y + entries[i].y + 5) * scale, entries[i].angle, scale,
-			i * strlen(path), strlen(path) * NUM_THREADS, p_coloring);
-		free(path);
+		transform_turtle_stack(&stacks[i], -info.min_x + 5, -info.min_y + 5, scale);
+		turtle turtle;
+		place_turtle(&turtle, &lsystem, (-info.min_x + 5) * scale, (-info.min_y + 5) * scale,
+			scale, entries[i].x, entries[i].y, entries[i].terms, entries[i].heading);
+		draw_path(&layers[i], &stream, &stacks[i], &turtle, scale, offsets[i],
+			offsets[NUM_THREADS], p_coloring);
+		clear_lsystem_stream(&stream);
+		if (halo_path != NULL) free(halo_path);
+		else clear_arena(&arena);
+#endif
+		#pragma omp barrier
+		merge_pixmaps(&img, layers, NUM_THREADS, i, NUM_THREADS, blend_lighten);
 	}
+	for (int i = 0; i < NUM_THREADS; ++i) clear_pixmap(&layers[i]);
 
-#ifndef DONT_WRITE_IMAGE
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
 	write_pixmap(&img, stdout);
 #endif
 
 	// Free the used memory
 	for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
 	free(dp);
+#ifdef SEEK_SPLIT
+	for (int i = 0; i <= n_iterations; ++i) free(lengths[i]);
+	free(lengths);
+#else
 	free(starting);
+	free(offsets);
 	free(initially_expanded_path);
+	free(nodes);
 	free(entries);
+	for (int i = 0; i < NUM_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
+	clear_path_scan(&scan);
+#endif
 	clear_lsystem(&lsystem);
 	clear_pixmap(&img);
 	return 0;
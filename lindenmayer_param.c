@@ -0,0 +1,505 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lindenmayer_param.h"
+
+#define PI 3.14159265359
+
+// Number of modules of a path that are expanded by a thread at a time
+#define PARAMETRIC_BLOCK_SIZE 65536
+
+typedef struct {
+	char *text;
+	int position;
+	// Names of the parameters of the predecessor
+	char *formals[PARAMETRIC_MAX_PARAMS];
+	int formal_lengths[PARAMETRIC_MAX_PARAMS];
+	int n_formals;
+	parametric_production *p_production;
+	int capacity, depth;
+} parametric_parser;
+
+static void skip_spaces(parametric_parser *p_parser)
+{
+	while (isspace((unsigned char)p_parser->text[p_parser->position])) ++p_parser->position;
+}
+
+// Append an instruction to the program, keeping track of the stack depth
+static int emit(parametric_parser *p_parser, uint8_t op, uint8_t arg, double constant)
+{
+	parametric_production *p_production = p_parser->p_production;
+	if (p_production->code_length == p_parser->capacity) {
+		p_parser->capacity = 2 * p_parser->capacity + 8;
+		p_production->code = realloc(p_production->code,
+		                             p_parser->capacity * sizeof(parametric_instruction));
+	}
+	parametric_instruction *p_instruction = &p_production->code[p_production->code_length++];
+	p_instruction->op = op;
+	p_instruction->arg = arg;
+	p_instruction->constant = constant;
+	if (op == PARAMETRIC_PUSH_CONSTANT || op == PARAMETRIC_PUSH_PARAM) ++p_parser->depth;
+	else if (op != PARAMETRIC_NEGATE) --p_parser->depth;
+	if (p_parser->depth > PARAMETRIC_MAX_STACK) {
+		fprintf(stderr, "ERROR: Expression too deep in %s.\n", p_parser->text);
+		return LINDENMAYER_ERROR;
+	}
+	return LINDENMAYER_SUCCESS;
+}
+
+static int parse_expression(parametric_parser *p_parser);
+
+// factor := number | parameter | '(' expression ')' | '-' factor
+static int parse_factor(parametric_parser *p_parser)
+{
+	skip_spaces(p_parser);
+	char *p = p_parser->text + p_parser->position;
+	if (*p == '-') {
+		++p_parser->position;
+		if (parse_factor(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+		return emit(p_parser, PARAMETRIC_NEGATE, 0, 0);
+	}
+	if (*p == '(') {
+		++p_parser->position;
+		if (parse_expression(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+		skip_spaces(p_parser);
+		if (p_parser->text[p_parser->position] != ')') {
+			fprintf(stderr, "ERROR: Missing ')' in %s.\n", p_parser->text);
+			return LINDENMAYER_ERROR;
+		}
+		++p_parser->position;
+		return LINDENMAYER_SUCCESS;
+	}
+	if (isdigit((unsigned char)*p) || *p == '.') {
+		char *end;
+		double constant = strtod(p, &end);
+		p_parser->position += end - p;
+		return emit(p_parser, PARAMETRIC_PUSH_CONSTANT, 0, constant);
+	}
+	int len = 0;
+	while (isalnum((unsigned char)p[len]) || p[len] == '_') ++len;
+	for (int k = 0; len > 0 && k < p_parser->n_formals; ++k) {
+		if (p_parser->formal_lengths[k] == len && strncmp(p_parser->formals[k], p, len) == 0) {
+			p_parser->position += len;
+			return emit(p_parser, PARAMETRIC_PUSH_PARAM, k, 0);
+		}
+	}
+	fprintf(stderr, "ERROR: Unexpected '%.*s' in %s.\n", len > 0 ? len : 1, p,
+	        p_parser->text);
+	return LINDENMAYER_ERROR;
+}
+
+// term := factor (('*' | '/') factor)*
+static int parse_term(parametric_parser *p_parser)
+{
+	if (parse_factor(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+	for (;;) {
+		skip_spaces(p_parser);
+		char c = p_parser->text[p_parser->position];
+		if (c != '*' && c != '/') return LINDENMAYER_SUCCESS;
+		++p_parser->position;
+		if (parse_factor(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+		if (emit(p_parser, c == '*' ? PARAMETRIC_MULTIPLY : PARAMETRIC_DIVIDE, 0, 0)
+		    != LINDENMAYER_SUCCESS) {
+			return LINDENMAYER_ERROR;
+		}
+	}
+}
+
+// expression := term (('+' | '-') term)*
+static int parse_expression(parametric_parser *p_parser)
+{
+	if (parse_term(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+	for (;;) {
+		skip_spaces(p_parser);
+		char c = p_parser->text[p_parser->position];
+		if (c != '+' && c != '-') return LINDENMAYER_SUCCESS;
+		++p_parser->position;
+		if (parse_term(p_parser) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+		if (emit(p_parser, c == '+' ? PARAMETRIC_ADD : PARAMETRIC_SUBTRACT, 0, 0)
+		    != LINDENMAYER_SUCCESS) {
+			return LINDENMAYER_ERROR;
+		}
+	}
+}
+
+// Every use of a symbol must have the same number of parameters
+static int declare_symbol(lindenmayer_parametric_system *p_lsystem, char c, int n)
+{
+	int i = (uint8_t)c;
+	if (n > PARAMETRIC_MAX_PARAMS) {
+		fprintf(stderr, "ERROR: Symbol %c has more than %d parameters.\n", c,
+		        PARAMETRIC_MAX_PARAMS);
+		return LINDENMAYER_ERROR;
+	}
+	if (p_lsystem->n_params[i] >= 0 && p_lsystem->n_params[i] != n) {
+		fprintf(stderr, "ERROR: Symbol %c has %d parameters, not %d.\n", c,
+		        p_lsystem->n_params[i], n);
+		return LINDENMAYER_ERROR;
+	}
+	p_lsystem->n_params[i] = n;
+	if (p_lsystem->max_params < n) p_lsystem->max_params = n;
+	return LINDENMAYER_SUCCESS;
+}
+
+// Compile the modules of the parser's text into its production
+static int parse_modules(lindenmayer_parametric_system *p_lsystem,
+	parametric_parser *p_parser)
+{
+	parametric_production *p_production = p_parser->p_production;
+	int text_len = strlen(p_parser->text);
+	p_production->symbols = malloc((text_len + 1) * sizeof(char));
+	p_production->n_modules = 0;
+	p_production->n_values = 0;
+	p_production->code = NULL;
+	p_production->code_length = 0;
+	p_parser->capacity = 0;
+	p_parser->depth = 0;
+	for (;;) {
+		skip_spaces(p_parser);
+		char c = p_parser->text[p_parser->position];
+		if (c == '\0') break;
+		if (c == '(' || c == ')' || c == ',') {
+			fprintf(stderr, "ERROR: Unexpected '%c' in %s.\n", c, p_parser->text);
+			return LINDENMAYER_ERROR;
+		}
+		++p_parser->position;
+		p_production->symbols[p_production->n_modules++] = c;
+		int n = 0;
+		if (p_parser->text[p_parser->position] == '(') {
+			do {
+				++p_parser->position;
+				if (p_production->n_values == 256) {
+					fprintf(stderr, "ERROR: Too many parameters in %s.\n", p_parser->text);
+					return LINDENMAYER_ERROR;
+				}
+				if (parse_expression(p_parser) != LINDENMAYER_SUCCESS ||
+				    emit(p_parser, PARAMETRIC_STORE, p_production->n_values++, 0)
+				    != LINDENMAYER_SUCCESS) {
+					return LINDENMAYER_ERROR;
+				}
+				++n;
+				skip_spaces(p_parser);
+			} while (p_parser->text[p_parser->position] == ',');
+			if (p_parser->text[p_parser->position] != ')') {
+				fprintf(stderr, "ERROR: Missing ')' in %s.\n", p_parser->text);
+				return LINDENMAYER_ERROR;
+			}
+			++p_parser->position;
+		}
+		if (declare_symbol(p_lsystem, c, n) != LINDENMAYER_SUCCESS) return LINDENMAYER_ERROR;
+	}
+	p_production->symbols[p_production->n_modules] = '\0';
+	if (p_lsystem->max_values < p_production->n_values) {
+		p_lsystem->max_values = p_production->n_values;
+	}
+	return LINDENMAYER_SUCCESS;
+}
+
+static void clear_production(parametric_production *p_production)
+{
+	free(p_production->symbols);
+	free(p_production->code);
+	p_production->symbols = NULL;
+	p_production->code = NULL;
+	p_production->n_modules = 0;
+	p_production->n_values = 0;
+	p_production->code_length = 0;
+}
+
+void initialize_parametric_system(lindenmayer_parametric_system *p_lsystem)
+{
+	for (int i = 0; i < 256; ++i) {
+		p_lsystem->n_params[i] = -1;
+		p_lsystem->productions[i] = NULL;
+		p_lsystem->is_forward[i] = 0;
+	}
+	p_lsystem->max_params = 0;
+	p_lsystem->max_values = 0;
+	p_lsystem->start.symbols = NULL;
+	p_lsystem->start.code = NULL;
+	clear_production(&p_lsystem->start);
+	p_lsystem->angle = 0;
+}
+
+void initialize_parametric_tree(lindenmayer_parametric_system *p_lsystem)
+{
+	initialize_parametric_system(p_lsystem);
+	add_parametric_production(p_lsystem, "A(s)", "F(s)[+(25)A(s*0.75)][-(35)A(s*0.65)]");
+	set_parametric_start(p_lsystem, "A(20)");
+	p_lsystem->is_forward[(int)'F'] = 1;
+	p_lsystem->angle = PI * 30 / 180;
+}
+
+int add_parametric_production(lindenmayer_parametric_system *p_lsystem,
+	char *predecessor, char *successor)
+{
+	parametric_parser parser;
+	parser.text = predecessor;
+	parser.position = 0;
+	parser.n_formals = 0;
+	skip_spaces(&parser);
+	char c = predecessor[parser.position++];
+	if (c == '\0' || c == '(' || c == ')' || c == ',') {
+		fprintf(stderr, "ERROR: Missing symbol in %s.\n", predecessor);
+		return LINDENMAYER_ERROR;
+	}
+	if (predecessor[parser.position] == '(') {
+		do {
+			++parser.position;
+			skip_spaces(&parser);
+			char *name = predecessor + parser.position;
+			int len = 0;
+			while (isalnum((unsigned char)name[len]) || name[len] == '_') ++len;
+			if (len == 0 || parser.n_formals == PARAMETRIC_MAX_PARAMS) {
+				fprintf(stderr, "ERROR: Invalid parameters in %s.\n", predecessor);
+				return LINDENMAYER_ERROR;
+			}
+			parser.formals[parser.n_formals] = name;
+			parser.formal_lengths[parser.n_formals++] = len;
+			parser.position += len;
+			skip_spaces(&parser);
+		} while (predecessor[parser.position] == ',');
+		if (predecessor[parser.position] != ')') {
+			fprintf(stderr, "ERROR: Missing ')' in %s.\n", predecessor);
+			return LINDENMAYER_ERROR;
+		}
+		++parser.position;
+	}
+	if (declare_symbol(p_lsystem, c, parser.n_formals) != LINDENMAYER_SUCCESS) {
+		return LINDENMAYER_ERROR;
+	}
+
+	parametric_production *p_production = malloc(sizeof(parametric_production));
+	parser.text = successor;
+	parser.position = 0;
+	parser.p_production = p_production;
+	if (parse_modules(p_lsystem, &parser) != LINDENMAYER_SUCCESS) {
+		clear_production(p_production);
+		free(p_production);
+		return LINDENMAYER_ERROR;
+	}
+	int i = (uint8_t)c;
+	if (p_lsystem->productions[i] != NULL) {
+		clear_production(p_lsystem->productions[i]);
+		free(p_lsystem->productions[i]);
+	}
+	p_lsystem->productions[i] = p_production;
+	return LINDENMAYER_SUCCESS;
+}
+
+int set_parametric_start(lindenmayer_parametric_system *p_lsystem, char *start)
+{
+	parametric_parser parser;
+	parser.text = start;
+	parser.position = 0;
+	parser.n_formals = 0;
+	parser.p_production = &p_lsystem->start;
+	clear_production(&p_lsystem->start);
+	if (parse_modules(p_lsystem, &parser) != LINDENMAYER_SUCCESS) {
+		clear_production(&p_lsystem->start);
+		return LINDENMAYER_ERROR;
+	}
+	return LINDENMAYER_SUCCESS;
+}
+
+void clear_parametric_system(lindenmayer_parametric_system *p_lsystem)
+{
+	for (int i = 0; i < 256; ++i) {
+		if (p_lsystem->productions[i] == NULL) continue;
+		clear_production(p_lsystem->productions[i]);
+		free(p_lsystem->productions[i]);
+		p_lsystem->productions[i] = NULL;
+	}
+	clear_production(&p_lsystem->start);
+}
+
+// Compute the parameters of the modules the production produces from the
+// parameters of the module it replaces
+static void run_production(parametric_production *p_production, double *params,
+	double *values)
+{
+	double stack[PARAMETRIC_MAX_STACK];
+	int top = 0;
+	parametric_instruction *code = p_production->code;
+	for (int k = 0; k < p_production->code_length; ++k) {
+		switch (code[k].op) {
+			case PARAMETRIC_PUSH_CONSTANT:
+				stack[top++] = code[k].constant;
+				break;
+			case PARAMETRIC_PUSH_PARAM:
+				stack[top++] = params[code[k].arg];
+				break;
+			case PARAMETRIC_ADD:
+				--top;
+				stack[top - 1] += stack[top];
+				break;
+			case PARAMETRIC_SUBTRACT:
+				--top;
+				stack[top - 1] -= stack[top];
+				break;
+			case PARAMETRIC_MULTIPLY:
+				--top;
+				stack[top - 1] *= stack[top];
+				break;
+			case PARAMETRIC_DIVIDE:
+				--top;
+				stack[top - 1] /= stack[top];
+				break;
+			case PARAMETRIC_NEGATE:
+				stack[top - 1] = -stack[top - 1];
+				break;
+			default:
+				values[code[k].arg] = stack[--top];
+		}
+	}
+}
+
+void initialize_parametric_path(lindenmayer_parametric_path *p_path,
+	lindenmayer_parametric_system *p_lsystem)
+{
+	p_path->symbols = malloc(sizeof(char));
+	p_path->symbols[0] = '\0';
+	for (int k = 0; k < PARAMETRIC_MAX_PARAMS; ++k) {
+		p_path->values[k] = k < p_lsystem->max_params ? malloc(sizeof(double)) : NULL;
+	}
+	p_path->length = 0;
+	p_path->capacity = 0;
+}
+
+// Make room for the given number of modules, dropping the ones in the path
+static void reserve_parametric_path(lindenmayer_parametric_path *p_path,
+	int64_t capacity)
+{
+	if (p_path->capacity >= capacity) return;
+	free(p_path->symbols);
+	p_path->symbols = malloc((capacity + 1) * sizeof(char));
+	for (int k = 0; k < PARAMETRIC_MAX_PARAMS; ++k) {
+		if (p_path->values[k] == NULL) continue;
+		free(p_path->values[k]);
+		p_path->values[k] = malloc(capacity * sizeof(double));
+	}
+	p_path->capacity = capacity;
+}
+
+// Write the modules produced by the given production, whose parameters are
+// in values, at the given index of the path
+static int64_t write_modules(lindenmayer_parametric_system *p_lsystem,
+	parametric_production *p_production, double *values,
+	lindenmayer_parametric_path *p_path, int64_t j)
+{
+	for (int v = 0, m = 0; m < p_production->n_modules; ++m, ++j) {
+		char c = p_production->symbols[m];
+		p_path->symbols[j] = c;
+		for (int k = 0; k < p_lsystem->n_params[(uint8_t)c]; ++k) {
+			p_path->values[k][j] = values[v++];
+		}
+	}
+	return j;
+}
+
+void expand_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, lindenmayer_parametric_path *p_new_path)
+{
+	int64_t path_len = p_path->length;
+	int n_blocks = (path_len + PARAMETRIC_BLOCK_SIZE - 1) / PARAMETRIC_BLOCK_SIZE;
+	int64_t *block_offsets = malloc((n_blocks + 1) * sizeof(int64_t));
+
+	#pragma omp parallel for if (n_blocks > 1)
+	for (int b = 0; b < n_blocks; ++b) {
+		int64_t end = b == n_blocks - 1 ? path_len : (int64_t)(b + 1) * PARAMETRIC_BLOCK_SIZE;
+		int64_t size = 0;
+		for (int64_t i = (int64_t)b * PARAMETRIC_BLOCK_SIZE; i < end; ++i) {
+			parametric_production *p_production =
+				p_lsystem->productions[(uint8_t)p_path->symbols[i]];
+			size += p_production == NULL ? 1 : p_production->n_modules;
+		}
+		block_offsets[b + 1] = size;
+	}
+	// Exclusive prefix sum, so each block knows where its output starts
+	block_offsets[0] = 0;
+	for (int b = 0; b < n_blocks; ++b) block_offsets[b + 1] += block_offsets[b];
+	reserve_parametric_path(p_new_path, block_offsets[n_blocks]);
+
+	#pragma omp parallel for if (n_blocks > 1)
+	for (int b = 0; b < n_blocks; ++b) {
+		int64_t end = b == n_blocks - 1 ? path_len : (int64_t)(b + 1) * PARAMETRIC_BLOCK_SIZE;
+		int64_t j = block_offsets[b];
+		double params[PARAMETRIC_MAX_PARAMS];
+		double *values = malloc((p_lsystem->max_values + 1) * sizeof(double));
+		for (int64_t i = (int64_t)b * PARAMETRIC_BLOCK_SIZE; i < end; ++i) {
+			char c = p_path->symbols[i];
+			int n_params = p_lsystem->n_params[(uint8_t)c];
+			parametric_production *p_production = p_lsystem->productions[(uint8_t)c];
+			if (p_production == NULL) {
+				p_new_path->symbols[j] = c;
+				for (int k = 0; k < n_params; ++k) {
+					p_new_path->values[k][j] = p_path->values[k][i];
+				}
+				++j;
+				continue;
+			}
+			for (int k = 0; k < n_params; ++k) params[k] = p_path->values[k][i];
+			run_production(p_production, params, values);
+			j = write_modules(p_lsystem, p_production, values, p_new_path, j);
+		}
+		free(values);
+	}
+	p_new_path->length = block_offsets[n_blocks];
+	p_new_path->symbols[p_new_path->length] = '\0';
+	free(block_offsets);
+}
+
+void expand_parametric_system(lindenmayer_parametric_system *p_lsystem, int n,
+	lindenmayer_parametric_path *p_path)
+{
+	parametric_production *p_start = &p_lsystem->start;
+	double *values = malloc((p_start->n_values + 1) * sizeof(double));
+	run_production(p_start, NULL, values);
+	reserve_parametric_path(p_path, p_start->n_modules);
+	p_path->length = write_modules(p_lsystem, p_start, values, p_path, 0);
+	p_path->symbols[p_path->length] = '\0';
+	free(values);
+
+	// Alternate between the given path and another one
+	lindenmayer_parametric_path other;
+	initialize_parametric_path(&other, p_lsystem);
+	for (int i = 0; i < n; ++i) {
+		expand_parametric_path(p_lsystem, p_path, &other);
+		lindenmayer_parametric_path tmp = *p_path;
+		*p_path = other;
+		other = tmp;
+	}
+	clear_parametric_path(&other);
+}
+
+void clear_parametric_path(lindenmayer_parametric_path *p_path)
+{
+	free(p_path->symbols);
+	p_path->symbols = NULL;
+	for (int k = 0; k < PARAMETRIC_MAX_PARAMS; ++k) {
+		free(p_path->values[k]);
+		p_path->values[k] = NULL;
+	}
+	p_path->length = 0;
+	p_path->capacity = 0;
+}
+
+double parametric_turn(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int64_t i)
+{
+	char c = p_path->symbols[i];
+	if (c != '+' && c != '-') return 0;
+	double turn = p_lsystem->n_params[(uint8_t)c] > 0 ? p_path->values[0][i] * PI / 180
+	                                                   : p_lsystem->angle;
+	return c == '+' ? turn : -turn;
+}
+
+double parametric_forward(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int64_t i)
+{
+	char c = p_path->symbols[i];
+	if (!p_lsystem->is_forward[(uint8_t)c]) return 0;
+	return p_lsystem->n_params[(uint8_t)c] > 0 ? p_path->values[0][i] : 1;
+}
@@ -0,0 +1,139 @@
+#ifndef LINDENMAYER_PARAM_H
+#define LINDENMAYER_PARAM_H
+
+#include "lindenmayer.h"
+
+// Largest number of parameters a module can have
+#define PARAMETRIC_MAX_PARAMS 4
+
+// Deepest the stack of values can get while evaluating a production
+#define PARAMETRIC_MAX_STACK 32
+
+// Instructions of the compiled productions
+#define PARAMETRIC_PUSH_CONSTANT 0
+#define PARAMETRIC_PUSH_PARAM 1
+#define PARAMETRIC_ADD 2
+#define PARAMETRIC_SUBTRACT 3
+#define PARAMETRIC_MULTIPLY 4
+#define PARAMETRIC_DIVIDE 5
+#define PARAMETRIC_NEGATE 6
+#define PARAMETRIC_STORE 7
+
+typedef struct {
+	uint8_t op;
+	uint8_t arg; // parameter to push or value to store
+	double constant;
+} parametric_instruction;
+
+/**
+ *    A production compiled to a program that computes all the parameters of
+ * the modules it produces, in order, from the parameters of the module it
+ * replaces. The start is compiled the same way, without parameters.
+ */
+typedef struct {
+	char *symbols; // symbols of the produced modules
+	int n_modules;
+	int n_values; // number of parameters of all the produced modules
+	parametric_instruction *code;
+	int code_length;
+} parametric_production;
+
+typedef struct {
+	int n_params[256]; // number of parameters of every symbol, -1 if not used
+	int max_params;
+	int max_values; // largest n_values of the productions
+	parametric_production *productions[256];
+	parametric_production start;
+	uint8_t is_forward[256];
+	double angle; // turn of the '+' and '-' modules without parameters
+} lindenmayer_parametric_system;
+
+/**
+ *    A path of modules stored as a structure of arrays: values[k][i] is the
+ * k-th parameter of the i-th module, if its symbol has that many. Only the
+ * first max_params arrays of the system are allocated.
+ */
+typedef struct {
+	char *symbols;
+	double *values[PARAMETRIC_MAX_PARAMS];
+	int64_t length, capacity;
+} lindenmayer_parametric_path;
+
+/**
+ *    Initialize a parametric system without productions, whose start is empty.
+ */
+void initialize_parametric_system(lindenmayer_parametric_system *p_lsystem);
+
+/**
+ *    A binary tree whose branches get shorter with every iteration.
+ */
+void initialize_parametric_tree(lindenmayer_parametric_system *p_lsystem);
+
+/**
+ *    Add the production of a module, like "A(s)" -> "F(s)[+A(s*0.7)]". The
+ * parameters of the produced modules are expressions of the ones of the
+ * predecessor made of numbers, + - * / and parentheses.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR if the
+ * production can not be parsed or a symbol gets a different number of
+ * parameters than before
+ */
+int add_parametric_production(lindenmayer_parametric_system *p_lsystem,
+	char *predecessor, char *successor);
+
+/**
+ *    Set the start of the system, whose parameters can only be constant
+ * expressions.
+ *    @return LINDENMAYER_SUCCESS if successful or LINDENMAYER_ERROR otherwise
+ */
+int set_parametric_start(lindenmayer_parametric_system *p_lsystem, char *start);
+
+/**
+ *    Deallocate the memory used by the given parametric system.
+ */
+void clear_parametric_system(lindenmayer_parametric_system *p_lsystem);
+
+/**
+ *    Initialize an empty path for modules of the given system.
+ */
+void initialize_parametric_path(lindenmayer_parametric_path *p_path,
+	lindenmayer_parametric_system *p_lsystem);
+
+/**
+ *    Expand the given path into new_path, whose buffers are reused when large
+ * enough. Every production runs its program once per module it replaces.
+ *    When compiled with OpenMP, the path is split in blocks whose expanded
+ * sizes are computed and prefix summed, after which all blocks are written
+ * to the new path concurrently.
+ */
+void expand_parametric_path(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, lindenmayer_parametric_path *p_new_path);
+
+/**
+ *    Expand the given parametric system for n times into the given
+ * initialized path.
+ */
+void expand_parametric_system(lindenmayer_parametric_system *p_lsystem, int n,
+	lindenmayer_parametric_path *p_path);
+
+/**
+ *    Deallocate the memory used by the given path.
+ */
+void clear_parametric_path(lindenmayer_parametric_path *p_path);
+
+/**
+ *    Return the heading change of the i-th module of the path: its first
+ * parameter in degrees for the '+' and '-' modules that have one, the angle
+ * of the system for the others and 0 if the module does not turn.
+ */
+double parametric_turn(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int64_t i);
+
+/**
+ *    Return the distance the i-th module of the path moves the turtle by: its
+ * first parameter for the forward modules that have one, 1 for the others and
+ * 0 if the module does not move.
+ */
+double parametric_forward(lindenmayer_parametric_system *p_lsystem,
+	lindenmayer_parametric_path *p_path, int64_t i);
+
+#endif
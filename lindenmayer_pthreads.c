@@ -14,38 +14,88 @@
 // Decomment to not write the image
 // #define DONT_WRITE_IMAGE
 
-void draw_path(pixmap_t *p_pixmap, lindenmayer_system *p_lsystem, char *path,
-               double start_x, double start_y, double start_angle, int scale,
-               int previous_length, int total_length, coloring_f coloring_f)
+// Decomment to draw the image right into this file instead of writing it
+// #define IMAGE_FILE "lindenmayer.ppm"
+
+// Decomment to keep the pixels of the image in tiles, which is faster to
+// draw on when the image is large
+// #define TILED_IMAGE
+
+// Decomment to walk the expansion lazily instead of building the whole path
+// #define STREAM_EXPANSION
+
+void draw_path(pixmap_t *p_pixmap, lindenmayer_stream *p_stream, turtle_stack *p_stack,
+               turtle *p_turtle, int scale, int64_t previous_length, int64_t total_length,
+               coloring_f coloring_f)
+{
+	// The start of every other chunk is drawn by the chunk before it
+	if (previous_length == 0) {
+		color_point(p_pixmap, p_turtle->x, p_turtle->y, coloring_f(0, total_length),
+		            blend_lighten);
+	}
+	turtle_op_stream ops;
+	turtle_op op;
+	initialize_turtle_op_stream(&ops, p_stream);
+	while (next_turtle_op(&ops, &op)) {
+		if (op.branch > 0) push_turtle(p_stack, p_turtle);
+		else if (op.branch < 0) pop_turtle(p_stack, p_turtle);
+		turn_turtle(p_turtle, op.turn);
+		for (int64_t i = op.index; i < op.index + op.forward; ++i) {
+			for (int j = 0; j < scale; ++j) {
+				step_turtle(p_turtle);
+				pixel_t pixel = coloring_f(previous_length + i, total_length);
+				color_point(p_pixmap, p_turtle->x, p_turtle->y, pixel, blend_lighten);
+			}
+		}
+	}
+}
+
+void draw_parametric_path(pixmap_t *p_pixmap, lindenmayer_parametric_system *p_lsystem,
+                          lindenmayer_parametric_path *p_path, turtle_stack *p_stack,
+                          int64_t begin, int64_t end, double start_x, double start_y,
+                          double start_angle, int scale, coloring_f coloring_f)
 {
 	double x = start_x;
 	double y = start_y;
 	double angle = start_angle;
 
-	color_point(p_pixmap, x, y, coloring_f(previous_length, total_length), blend_lighten);
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (p_lsystem->is_forward[(int)path[i]]) {
-			for (int j = 0; j < scale; ++j) {
-				x += cos(angle);
-				y += sin(angle);
-				pixel_t pixel = coloring_f(previous_length + i, total_length);
+	// The start of every other chunk is drawn by the chunk before it
+	if (begin == 0) color_point(p_pixmap, x, y, coloring_f(0, p_path->length), blend_lighten);
+	for (int64_t i = begin; i < end; ++i) {
+		char c = p_path->symbols[i];
+		double forward = parametric_forward(p_lsystem, p_path, i) * scale;
+		if (forward != 0) {
+			// Move by steps of about a pixel, like the other systems do
+			int n_steps = ceil(fabs(forward));
+			double dx = forward * cos(angle) / n_steps;
+			double dy = forward * sin(angle) / n_steps;
+			pixel_t pixel = coloring_f(i, p_path->length);
+			for (int j = 0; j < n_steps; ++j) {
+				x += dx;
+				y += dy;
 				color_point(p_pixmap, x, y, pixel, blend_lighten);
 			}
-		} else if (path[i] == '+') {
-				angle += p_lsystem->angle;
-		} else if (path[i] == '-') {
-				angle -= p_lsystem->angle;
+		} else if (c == '[') {
+			push_turtle_state(p_stack, x, y, angle);
+		} else if (c == ']') {
+			pop_turtle_state(p_stack, &x, &y, &angle);
+		} else {
+			angle += parametric_turn(p_lsystem, p_path, i);
 		}
 	}
 }
 
 typedef struct {
 	int starting, ending, i;
+	int64_t previous_length, total_length;
 	int n_iterations, scale;
 	char *initially_expanded_path;
+	uint64_t *nodes;
 	lindenmayer_dp_entry *p_info, *p_entry;
+	lindenmayer_path_scan *p_scan;
+	turtle_stack *p_stack;
 	lindenmayer_system *p_lsystem;
-	pixmap_t *p_pixmap;
+	pixmap_t *p_pixmap, *p_layers; // every thread draws on its own layer
 	coloring_f *p_coloring;
 } thread_info_t;
 
@@ -53,24 +103,178 @@ void *thread_function(void *p_info) {
 	thread_info_t *p = (thread_info_t *)p_info;
 	int end = p->ending;
 	int len = end - p->starting;
-	char *path = malloc((len + 1) * sizeof(char));
-	memcpy(path, p->initially_expanded_path + p->starting, len);
-	path[len] = '\0';
-	for (int j = 0; j < p->n_iterations - INITIAL_EXPANDS; ++j) {
-		char *tmp = path;
-		path = expand_path(p->p_lsystem, tmp);
-		free(tmp);
+	char *chunk = p->initially_expanded_path + p->starting;
+	uint64_t *chunk_nodes = p->nodes == NULL ? NULL : p->nodes + p->starting;
+	lindenmayer_arena arena;
+	char *halo_path = NULL;
+	lindenmayer_stream stream;
+	// Only streams follow the derivation of stochastic systems
+	int use_stream = p->p_lsystem->is_stochastic;
+#ifdef STREAM_EXPANSION
+	use_stream = 1;
+#endif
+	if (p->p_lsystem->is_context_sensitive) {
+		// The scan kept the expansions of the symbols, which saw their context
+		halo_path = join_path_scan(p->p_scan, p->initially_expanded_path, p->starting,
+			p->ending, NULL);
+		initialize_lsystem_stream(&stream, p->p_lsystem, halo_path, 0);
+	} else if (use_stream) {
+		// Only copy the chunk, the stream expands it
+		initialize_arena(&arena, p->p_lsystem, chunk, len, 0);
+		char *path = expand_in_arena(p->p_lsystem, &arena, chunk, len, 0);
+		initialize_derivation_stream(&stream, p->p_lsystem, path, chunk_nodes,
+		                             p->n_iterations - INITIAL_EXPANDS);
+	} else {
+		initialize_arena(&arena, p->p_lsystem, chunk, len, p->n_iterations - INITIAL_EXPANDS);
+		char *path = expand_in_arena(p->p_lsystem, &arena, chunk, len, p->n_iterations - INITIAL_EXPANDS);
+		initialize_lsystem_stream(&stream, p->p_lsystem, path, 0);
 	}
 	// Draw the lines
-	draw_path(p->p_pixmap, p->p_lsystem, path,
-		(-p->p_info->min_x + p->p_entry->x + 5) * p->scale,
+	transform_turtle_stack(p->p_stack, -p->p_info->min_x + 5, -p->p_info->min_y + 5, p->scale);
+	turtle turtle;
+	place_turtle(&turtle, p->p_lsystem, (-p->p_info->min_x + 5) * p->scale,
+		(-p->p_info->min_y + 5) * p->scale, p->scale, p->p_entry->x, p->p_entry->y,
+		p->p_entry->terms, p->p_entry->heading);
+	draw_path(&p->p_layers[p->i], &stream, p->p_stack, &turtle, p->scale,
+		p->previous_length, p->total_length, p->p_coloring);
+	clear_lsystem_stream(&stream);
+	if (halo_path != NULL) free(halo_path);
+	else clear_arena(&arena);
+
+	return NULL;
+}
+
+typedef struct {
+	int i, scale;
+	int64_t begin, end;
+	lindenmayer_dp_entry *p_info, *p_entry;
+	turtle_stack *p_stack;
+	lindenmayer_parametric_system *p_lsystem;
+	lindenmayer_parametric_path *p_path;
+	pixmap_t *p_layers; // every thread draws on its own layer
+	coloring_f *p_coloring;
+} parametric_thread_info_t;
+
+void *parametric_thread_function(void *p_info) {
+	parametric_thread_info_t *p = (parametric_thread_info_t *)p_info;
+	transform_turtle_stack(p->p_stack, -p->p_info->min_x + 5, -p->p_info->min_y + 5, p->scale);
+	draw_parametric_path(&p->p_layers[p->i], p->p_lsystem, p->p_path, p->p_stack, p->begin,
+		p->end, (-p->p_info->min_x + p->p_entry->x + 5) * p->scale,
 		(-p->p_info->min_y + p->p_entry->y + 5) * p->scale, p->p_entry->angle, p->scale,
-		p->i * strlen(path), strlen(path) * N_THREADS, p->p_coloring);
-	free(path);
+		p->p_coloring);
+	return NULL;
+}
 
+// Blend a band of lines of all the layers into the image
+void *merge_thread_function(void *p_info) {
+	thread_info_t *p = (thread_info_t *)p_info;
+	merge_pixmaps(p->p_pixmap, p->p_layers, N_THREADS, p->i, N_THREADS, blend_lighten);
 	return NULL;
 }
 
+// Initialize the image and the n_layers layers the threads draw on, or nothing
+// if any of them can not be allocated
+int initialize_pixmaps(pixmap_t *p_img, pixmap_t *layers, int n_layers, int width,
+	int height)
+{
+#ifdef IMAGE_FILE
+	if (initialize_file_backed_pixmap(p_img, width, height, IMAGE_FILE) != PIXMAP_SUCCESS) {
+#elif defined(TILED_IMAGE)
+	if (initialize_tiled_pixmap(p_img, width, height) != PIXMAP_SUCCESS) {
+#else
+	if (initialize_pixmap(p_img, width, height) != PIXMAP_SUCCESS) {
+#endif
+		return PIXMAP_ERROR;
+	}
+	// Only the tiles drawn on are allocated
+	for (int i = 0; i < n_layers; ++i) {
+		if (initialize_tiled_pixmap(&layers[i], width, height) != PIXMAP_SUCCESS) {
+			while (i > 0) clear_pixmap(&layers[--i]);
+			clear_pixmap(p_img);
+			return PIXMAP_ERROR;
+		}
+	}
+	return PIXMAP_SUCCESS;
+}
+
+// Parametric systems have their own paths, which are split between the
+// threads by the distance they draw
+int run_parametric_system(int n_iterations, int scale, coloring_f *p_coloring)
+{
+	pixmap_t img;
+	lindenmayer_parametric_system lsystem;
+	lindenmayer_parametric_path path;
+	initialize_parametric_tree(&lsystem);
+	initialize_parametric_path(&path, &lsystem);
+	expand_parametric_system(&lsystem, n_iterations, &path);
+	int64_t *starting = malloc((N_THREADS + 1) * sizeof(int64_t));
+	lindenmayer_dp_entry *entries = malloc(N_THREADS * sizeof(lindenmayer_dp_entry));
+	turtle_stack *stacks = malloc(N_THREADS * sizeof(turtle_stack));
+	partition_parametric_path(&lsystem, &path, N_THREADS, starting);
+	lindenmayer_dp_entry info = scan_parametric_path(&lsystem, &path, entries, stacks,
+		starting, N_THREADS);
+
+	// Initialize pixmap_t
+	int height = (info.max_x - info.min_x + 10) * scale;
+	int width = (info.max_y - info.min_y + 10) * scale;
+	pixmap_t layers[N_THREADS];
+	if (initialize_pixmaps(&img, layers, N_THREADS, width, height) != PIXMAP_SUCCESS) {
+		free(starting);
+		free(entries);
+		for (int i = 0; i < N_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_parametric_path(&path);
+		clear_parametric_system(&lsystem);
+		return -1;
+	}
+
+	// Draw fractal, every thread on its own layer so that they do not race for
+	// the pixels, then blend the layers
+	pthread_t threads[N_THREADS];
+	parametric_thread_info_t infos[N_THREADS];
+	thread_info_t merges[N_THREADS]; // only the fields the merge reads are set
+	for (int i = 0; i < N_THREADS; ++i) {
+		infos[i].i = i;
+		infos[i].scale = scale;
+		infos[i].begin = starting[i];
+		infos[i].end = starting[i + 1];
+		infos[i].p_info = &info;
+		infos[i].p_entry = &entries[i];
+		infos[i].p_stack = &stacks[i];
+		infos[i].p_lsystem = &lsystem;
+		infos[i].p_path = &path;
+		infos[i].p_layers = layers;
+		infos[i].p_coloring = p_coloring;
+		pthread_create(&threads[i], NULL, parametric_thread_function, &infos[i]);
+	}
+	for (int i = 0; i < N_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < N_THREADS; ++i) {
+		merges[i].i = i;
+		merges[i].p_pixmap = &img;
+		merges[i].p_layers = layers;
+		pthread_create(&threads[i], NULL, merge_thread_function, &merges[i]);
+	}
+	for (int i = 0; i < N_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < N_THREADS; ++i) clear_pixmap(&layers[i]);
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
+	write_pixmap(&img, stdout);
+#endif
+
+	// Free the used memory
+	free(starting);
+	free(entries);
+	for (int i = 0; i < N_THREADS; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
+	clear_parametric_path(&path);
+	clear_parametric_system(&lsystem);
+	clear_pixmap(&img);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc != 5) {
@@ -82,6 +286,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "   3 = Quadratic Gosper\n");
 		fprintf(stderr, "   4 = Levy Curve\n");
 		fprintf(stderr, "   5 = Pentaplexity\n");
+		fprintf(stderr, "   6 = Fractal Plant\n");
+		fprintf(stderr, "   7 = Stochastic Plant\n");
+		fprintf(stderr, "   8 = Parametric Tree\n");
+		fprintf(stderr, "   9 = Context Koch Curve\n");
 		fprintf(stderr, "Coloring type is:\n");
 		fprintf(stderr, "   0 = HSV coloring\n");
 		fprintf(stderr, "   1 = Christmas coloring\n");
@@ -91,6 +299,11 @@ int main(int argc, char *argv[])
 	lindenmayer_system lsystem;
 	coloring_f *p_coloring;
 
+	if (atoi(argv[1]) == 8) {
+		p_coloring = atoi(argv[4]) == 1 ? christmas_coloring : hsv_coloring;
+		return run_parametric_system(atoi(argv[2]), atoi(argv[3]), p_coloring);
+	}
+
 	// Chose the curve type
 	switch (atoi(argv[1])) {
 		case 0:
@@ -111,9 +324,20 @@ int main(int argc, char *argv[])
 		case 5:
 			initialize_pentaplexity(&lsystem);
 			break;
+		case 6:
+			initialize_fractal_plant(&lsystem);
+			break;
+		case 7:
+			initialize_stochastic_plant(&lsystem);
+			break;
+		case 9:
+			initialize_context_koch_curve(&lsystem);
+			break;
 		default:
 			initialize_dragon_curve(&lsystem);
 	}
+	// The symbols that are never drawn only make the paths longer
+	eliminate_dead_symbols(&lsystem);
 	// Choose the coloring type
 	if (atoi(argv[4]) == 1) p_coloring = christmas_coloring;
 	else p_coloring = hsv_coloring;
@@ -123,44 +347,75 @@ int main(int argc, char *argv[])
 	int n_iterations = atoi(argv[2]);
 	int scale = atoi(argv[3]);
 	lindenmayer_dp_entry **dp = create_lindenmayer_dp_table(&lsystem, n_iterations);
-	char *initially_expanded_path = expand_lsystem(&lsystem, INITIAL_EXPANDS);
-	int initially_expanded_path_len = strlen(initially_expanded_path);
-	int *starting = malloc(n_threads * sizeof(int));
+	uint64_t *nodes;
+	char *initially_expanded_path = expand_lsystem_with_nodes(&lsystem, INITIAL_EXPANDS, &nodes);
+	int *starting = malloc((n_threads + 1) * sizeof(int));
+	int64_t *offsets = malloc((n_threads + 1) * sizeof(int64_t));
 	lindenmayer_dp_entry *entries = malloc(n_threads * sizeof(lindenmayer_dp_entry));
-	for (int i = 0; i < n_threads; ++i) {
-		starting[i] = i * initially_expanded_path_len / n_threads;
-	}
-	lindenmayer_dp_entry info = scan_rule(&lsystem, initially_expanded_path,
-		dp[n_iterations - INITIAL_EXPANDS], compute_no_of_variables(&lsystem), 1,
-		entries, starting, n_threads);
+	turtle_stack *stacks = malloc(n_threads * sizeof(turtle_stack));
+	lindenmayer_path_scan scan;
+	scan_varying_path(&lsystem, initially_expanded_path, nodes, n_iterations - INITIAL_EXPANDS,
+	                  1, &scan);
+	partition_by_cost(&lsystem, initially_expanded_path, &scan, n_iterations - INITIAL_EXPANDS,
+	                  n_threads, starting, offsets);
+	lindenmayer_dp_entry info = scan_path(&lsystem, initially_expanded_path, &scan,
+		dp, n_iterations - INITIAL_EXPANDS, entries, stacks, starting, n_threads);
 
 	// Initialize pixmap_t
 	int height = (info.max_x - info.min_x + 10) * scale;
 	int width = (info.max_y - info.min_y + 10) * scale;
-	initialize_pixmap(&img, width, height);
+	pixmap_t layers[N_THREADS];
+	if (initialize_pixmaps(&img, layers, n_threads, width, height) != PIXMAP_SUCCESS) {
+		for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
+		free(dp);
+		free(starting);
+		free(offsets);
+		free(initially_expanded_path);
+		free(nodes);
+		free(entries);
+		for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+		free(stacks);
+		clear_path_scan(&scan);
+		clear_lsystem(&lsystem);
+		return -1;
+	}
 
-	// Draw fractal
+	// Draw fractal, every thread on its own layer so that they do not race for
+	// the pixels, then blend the layers
 	pthread_t threads[N_THREADS];
 	thread_info_t infos[N_THREADS];
 	for (int i = 0; i < n_threads; ++i) {
 		// Expand the string
 		infos[i].starting = starting[i];
-		infos[i].ending = (i + 1) * initially_expanded_path_len / n_threads;
+		infos[i].ending = starting[i + 1];
+		infos[i].previous_length = offsets[i];
+		infos[i].total_length = offsets[n_threads];
 		infos[i].i = i;
 		infos[i].n_iterations = n_iterations;
 		infos[i].scale = scale;
 		infos[i].initially_expanded_path = initially_expanded_path;
+		infos[i].nodes = nodes;
 		infos[i].p_info = &info;
 		infos[i].p_entry = &entries[i];
+		infos[i].p_scan = &scan;
+		infos[i].p_stack = &stacks[i];
 		infos[i].p_lsystem = &lsystem;
 		infos[i].p_pixmap = &img;
+		infos[i].p_layers = layers;
 		infos[i].p_coloring = p_coloring;
 		pthread_create(&threads[i], NULL, thread_function, &infos[i]);
 	}
 	for (int i = 0; i < n_threads; ++i) {
 		pthread_join(threads[i], NULL);
 	}
-#ifndef DONT_WRITE_IMAGE
+	for (int i = 0; i < n_threads; ++i) {
+		pthread_create(&threads[i], NULL, merge_thread_function, &infos[i]);
+	}
+	for (int i = 0; i < n_threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < n_threads; ++i) clear_pixmap(&layers[i]);
+#if !defined(DONT_WRITE_IMAGE) && !defined(IMAGE_FILE)
 	write_pixmap(&img, stdout);
 #endif
 
@@ -168,8 +423,13 @@ int main(int argc, char *argv[])
 	for (int i = 0; i <= n_iterations; ++i) free(dp[i]);
 	free(dp);
 	free(starting);
+	free(offsets);
 	free(initially_expanded_path);
+	free(nodes);
 	free(entries);
+	for (int i = 0; i < n_threads; ++i) clear_turtle_stack(&stacks[i]);
+	free(stacks);
+	clear_path_scan(&scan);
 	clear_lsystem(&lsystem);
 	clear_pixmap(&img);
 	return 0;
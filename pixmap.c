@@ -1,7 +1,12 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "pixmap.h"
 
@@ -56,6 +61,44 @@ pixel_t blend_lighten(pixel_t a, pixel_t b) {
 	return ans;
 }
 
+// Point the lines of the pixmap into its pixels, which start at the given
+// offset of its mapping
+static int attach_lines(pixmap_t *p_pixmap, size_t offset)
+{
+	p_pixmap->pixels = malloc(p_pixmap->height * sizeof(pixel_t *));
+	if (p_pixmap->pixels == NULL) {
+		fprintf(stderr, "ERROR: Not enough memory to allocate pixmap.\n");
+		munmap(p_pixmap->p_map, p_pixmap->map_size);
+		p_pixmap->p_map = NULL;
+		return PIXMAP_ERROR;
+	}
+	pixel_t *data = (pixel_t *)(p_pixmap->p_map + offset);
+	for (int i = 0; i < p_pixmap->height; ++i) {
+		p_pixmap->pixels[i] = data + (size_t)i * p_pixmap->width;
+	}
+	return PIXMAP_SUCCESS;
+}
+
+// Map the given number of black pixels anonymously
+static int map_pixels(pixmap_t *p_pixmap, size_t n_pixels)
+{
+	// Anonymous pages are black until drawn on, so large pixmaps are not
+	// cleared up front
+	p_pixmap->map_size = n_pixels * sizeof(pixel_t);
+	p_pixmap->p_map = mmap(NULL, p_pixmap->map_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p_pixmap->p_map == MAP_FAILED) {
+		fprintf(stderr, "ERROR: Not enough memory to allocate pixmap.\n");
+		p_pixmap->p_map = NULL;
+		return PIXMAP_ERROR;
+	}
+#ifdef MADV_HUGEPAGE
+	// The points are scattered, so fewer pages spare misses of the TLB
+	madvise(p_pixmap->p_map, p_pixmap->map_size, MADV_HUGEPAGE);
+#endif
+	return PIXMAP_SUCCESS;
+}
+
 int initialize_pixmap(pixmap_t *p_pixmap, int width, int height)
 {
 	if (width <= 0 || height <= 0) {
@@ -65,48 +108,161 @@ int initialize_pixmap(pixmap_t *p_pixmap, int width, int height)
 
 	p_pixmap->width = width;
 	p_pixmap->height = height;
+	p_pixmap->pixels = NULL;
+	p_pixmap->tiles_per_line = 0;
+	p_pixmap->tile_slots = NULL;
 
-	/* Allocate the pixel matrix, catching the allocation errors */
-	p_pixmap->pixels = malloc(height * sizeof(pixel_t *));
-	if (p_pixmap->pixels == NULL) {
-		fprintf(stderr, "ERROR: Not enough memory to allocate pixmap.\n");
+	if (map_pixels(p_pixmap, (size_t)width * height) != PIXMAP_SUCCESS) {
 		return PIXMAP_ERROR;
 	}
-	for (int i = 0; i < height; ++i) {
-		p_pixmap->pixels[i] = malloc(width * sizeof(pixel_t));
-		if (p_pixmap->pixels[i] == NULL) {
-			// Free already allocated memory on error (preventing leaks)
-			fprintf(stderr, "ERROR: Not enough memory to allocate pixmap.\n");
-			for (int j = 0; j < i; ++j) free(p_pixmap->pixels[j]);
-			free(p_pixmap->pixels);
-			p_pixmap->pixels = NULL;
-			return PIXMAP_ERROR;
-		}
-		memset(p_pixmap->pixels[i], 0, width * sizeof(pixel_t));
+	return attach_lines(p_pixmap, 0);
+}
+
+int initialize_tiled_pixmap(pixmap_t *p_pixmap, int width, int height)
+{
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "ERROR: Invalid height or width for pixmap.\n");
+		return PIXMAP_ERROR;
 	}
 
+	p_pixmap->width = width;
+	p_pixmap->height = height;
+	p_pixmap->pixels = NULL;
+
+	// The tiles on the right and bottom borders are stored whole
+	int tile_size = 1 << PIXMAP_TILE_SHIFT;
+	p_pixmap->tiles_per_line = (width + tile_size - 1) >> PIXMAP_TILE_SHIFT;
+	size_t n_tiles = ((height + tile_size - 1) >> PIXMAP_TILE_SHIFT) *
+	                 (size_t)p_pixmap->tiles_per_line;
+	p_pixmap->tile_slots = calloc(n_tiles, sizeof(uint32_t));
+	p_pixmap->n_slots = 0;
+	if (p_pixmap->tile_slots == NULL) {
+		fprintf(stderr, "ERROR: Not enough memory to allocate pixmap.\n");
+		p_pixmap->p_map = NULL;
+		return PIXMAP_ERROR;
+	}
+	if (map_pixels(p_pixmap, n_tiles * tile_size * tile_size) != PIXMAP_SUCCESS) {
+		free(p_pixmap->tile_slots);
+		return PIXMAP_ERROR;
+	}
 	return PIXMAP_SUCCESS;
 }
 
+int initialize_file_backed_pixmap(pixmap_t *p_pixmap, int width, int height,
+	char *path)
+{
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "ERROR: Invalid height or width for pixmap.\n");
+		return PIXMAP_ERROR;
+	}
+
+	p_pixmap->width = width;
+	p_pixmap->height = height;
+	p_pixmap->pixels = NULL;
+	p_pixmap->tiles_per_line = 0;
+	p_pixmap->tile_slots = NULL;
+	p_pixmap->p_map = NULL;
+
+	char header[64];
+	size_t header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+	p_pixmap->map_size = header_size + (size_t)width * height * sizeof(pixel_t);
+	// The file is extended with zeros, so all the pixels are black
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, p_pixmap->map_size) != 0) {
+		fprintf(stderr, "ERROR: Can not create the pixmap file %s.\n", path);
+		if (fd >= 0) close(fd);
+		return PIXMAP_ERROR;
+	}
+	p_pixmap->p_map = mmap(NULL, p_pixmap->map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p_pixmap->p_map == MAP_FAILED) {
+		fprintf(stderr, "ERROR: Can not map the pixmap file %s.\n", path);
+		p_pixmap->p_map = NULL;
+		return PIXMAP_ERROR;
+	}
+	memcpy(p_pixmap->p_map, header, header_size);
+
+	return attach_lines(p_pixmap, header_size);
+}
+
 int clear_pixmap(pixmap_t *p_pixmap)
 {
-	if (p_pixmap->pixels == NULL) {
+	if (p_pixmap->p_map == NULL) {
 		fprintf(stderr, "ERROR: Deallocating unallocated pixmap.\n");
 		return PIXMAP_ERROR;
 	}
 
-	// Deallocate the matrix
-	for (int i = 0; i < p_pixmap->height; ++i) free(p_pixmap->pixels[i]);
+	// Unmapping a file backed pixmap leaves its pixels in the file
+	munmap(p_pixmap->p_map, p_pixmap->map_size);
+	p_pixmap->p_map = NULL;
 	free(p_pixmap->pixels);
 	p_pixmap->pixels = NULL;
+	free(p_pixmap->tile_slots);
+	p_pixmap->tile_slots = NULL;
+
+	return PIXMAP_SUCCESS;
+}
+
+// Return the address of the given pixel, which is followed by the next pixels
+// of its line up to the end of its tile. A tile not drawn on gets a slot if
+// allocate is not 0, otherwise NULL is returned for its pixels.
+static pixel_t *pixel_address(pixmap_t *p_pixmap, int x, int y, int allocate)
+{
+	if (p_pixmap->pixels != NULL) return &p_pixmap->pixels[x][y];
+	size_t tile = (size_t)(x >> PIXMAP_TILE_SHIFT) * p_pixmap->tiles_per_line +
+	              (y >> PIXMAP_TILE_SHIFT);
+	uint32_t slot = p_pixmap->tile_slots[tile];
+	if (slot == 0) {
+		if (!allocate) return NULL;
+		// Threads can blend different tiles of a pixmap at the same time
+		slot = __sync_add_and_fetch(&p_pixmap->n_slots, 1);
+		p_pixmap->tile_slots[tile] = slot;
+	}
+	// The pixel in the slot of its tile
+	int mask = (1 << PIXMAP_TILE_SHIFT) - 1;
+	return (pixel_t *)p_pixmap->p_map + ((size_t)(slot - 1) << (2 * PIXMAP_TILE_SHIFT)) +
+	       ((x & mask) << PIXMAP_TILE_SHIFT) + (y & mask);
+}
 
+// Write the pixels of a tiled pixmap line after line, gathering the lines of
+// a row of tiles at a time
+static int write_tiles(pixmap_t *p_pixmap, FILE *p_file)
+{
+	int tile_size = 1 << PIXMAP_TILE_SHIFT;
+	size_t band_size = (size_t)tile_size * p_pixmap->width;
+	pixel_t *band = malloc(band_size * sizeof(pixel_t));
+	if (band == NULL) {
+		fprintf(stderr, "ERROR: Not enough memory to write pixmap.\n");
+		return PIXMAP_ERROR;
+	}
+	for (int x = 0; x < p_pixmap->height; x += tile_size) {
+		int n_lines = p_pixmap->height - x < tile_size ? p_pixmap->height - x : tile_size;
+		for (int y = 0; y < p_pixmap->width; y += tile_size) {
+			int n_columns = p_pixmap->width - y < tile_size ? p_pixmap->width - y : tile_size;
+			pixel_t *tile = pixel_address(p_pixmap, x, y, 0);
+			for (int i = 0; i < n_lines; ++i) {
+				pixel_t *line = band + (size_t)i * p_pixmap->width + y;
+				if (tile == NULL) memset(line, 0, n_columns * sizeof(pixel_t));
+				else memcpy(line, tile + i * tile_size, n_columns * sizeof(pixel_t));
+			}
+		}
+		size_t n_pixels = (size_t)n_lines * p_pixmap->width;
+		if (fwrite(band, sizeof(pixel_t), n_pixels, p_file) != n_pixels) {
+			fprintf(stderr, "ERROR: While writing line %d.\n", x);
+			free(band);
+			return PIXMAP_ERROR;
+		}
+	}
+	free(band);
+	fflush(p_file);
 	return PIXMAP_SUCCESS;
 }
 
 int write_pixmap(pixmap_t *p_pixmap, FILE *p_file)
 {
 	int e;
-	if (p_pixmap->pixels == NULL) {
+	if (p_pixmap->p_map == NULL) {
 		fprintf(stderr, "ERROR: Writing unallocated pixmap.\n");
 		return PIXMAP_ERROR;
 	}
@@ -120,20 +276,63 @@ int write_pixmap(pixmap_t *p_pixmap, FILE *p_file)
 
 	// Flush because fprintf and fwrite might print differently
 	fflush(p_file);
-	for (int i = 0; i < p_pixmap->height; ++i) {
-		e = fwrite(p_pixmap->pixels[i], sizeof(pixel_t), p_pixmap->width, p_file);
-		if (e != p_pixmap->width) {
-			fprintf(stderr, "ERROR: While writing line %d.\n", i);
-			return PIXMAP_ERROR;
-		}
+	if (p_pixmap->pixels == NULL) return write_tiles(p_pixmap, p_file);
+	// The lines are contiguous, so they are written at once
+	size_t n_pixels = (size_t)p_pixmap->width * p_pixmap->height;
+	if (fwrite(p_pixmap->pixels[0], sizeof(pixel_t), n_pixels, p_file) != n_pixels) {
+		fprintf(stderr, "ERROR: While writing the pixels.\n");
+		return PIXMAP_ERROR;
 	}
 	fflush(p_file);
 
 	return PIXMAP_SUCCESS;
 }
 
+// Return 1 if all the given pixels are black, or 0 otherwise
+static int is_black(pixel_t *p_pixels, int n)
+{
+	uint8_t *bytes = (uint8_t *)p_pixels;
+	uint8_t any = 0;
+	for (int j = 0; j < n * (int)sizeof(pixel_t); ++j) any |= bytes[j];
+	return any == 0;
+}
+
+void merge_pixmaps(pixmap_t *p_pixmap, pixmap_t *p_others, int n_others, int part,
+	int n_parts, blend_f *f)
+{
+	int tile_size = 1 << PIXMAP_TILE_SHIFT;
+	int n_tile_lines = (p_pixmap->height + tile_size - 1) >> PIXMAP_TILE_SHIFT;
+	int n_tile_columns = (p_pixmap->width + tile_size - 1) >> PIXMAP_TILE_SHIFT;
+	int first = (int)((int64_t)n_tile_lines * part / n_parts);
+	int last = (int)((int64_t)n_tile_lines * (part + 1) / n_parts);
+	for (int tile_x = first; tile_x < last; ++tile_x) {
+		int x = tile_x << PIXMAP_TILE_SHIFT;
+		int n_lines = p_pixmap->height - x < tile_size ? p_pixmap->height - x : tile_size;
+		for (int tile_y = 0; tile_y < n_tile_columns; ++tile_y) {
+			int y = tile_y << PIXMAP_TILE_SHIFT;
+			int n = p_pixmap->width - y < tile_size ? p_pixmap->width - y : tile_size;
+			for (int k = 0; k < n_others; ++k) {
+				// Both layouts keep the pixels of a line in a tile together
+				for (int i = 0; i < n_lines; ++i) {
+					pixel_t *p_drawn = pixel_address(&p_others[k], x + i, y, 0);
+					if (p_drawn == NULL) break;
+					if (is_black(p_drawn, n)) continue;
+					pixel_t *p_pixel = pixel_address(p_pixmap, x + i, y, 1);
+					for (int j = 0; j < n; ++j) {
+						if (p_drawn[j].r == 0 && p_drawn[j].g == 0 && p_drawn[j].b == 0) continue;
+						p_pixel[j] = f(p_pixel[j], p_drawn[j]);
+					}
+				}
+			}
+		}
+	}
+}
+
 void color_point(pixmap_t *p_pixmap, double x, double y, pixel_t pixel, blend_f *f)
 {
+	// Skip the points whose closest pixel is outside of the pixmap
+	if (!(x > -0.5 && x <= p_pixmap->height - 0.5 &&
+	      y > -0.5 && y <= p_pixmap->width - 0.5)) return;
 	// Calculate the distance to the nearest pixels
 	double a = x - (int)x;
 	double b = y - (int)y;
@@ -141,6 +340,6 @@ void color_point(pixmap_t *p_pixmap, double x, double y, pixel_t pixel, blend_f
 	// Other option would be linear interpolation
 	int discret_x = a <= 0.5 ? (int)x : (int)x + 1;
 	int discret_y = b <= 0.5 ? (int)y : (int)y + 1;
-	p_pixmap->pixels[discret_x][discret_y] =
-		f(p_pixmap->pixels[discret_x][discret_y], pixel);
+	pixel_t *p_pixel = pixel_address(p_pixmap, discret_x, discret_y, 1);
+	*p_pixel = f(*p_pixel, pixel);
 }
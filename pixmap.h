@@ -15,9 +15,25 @@ typedef struct {
 } pixel_t;
 #pragma pack()
 
+// Tiled pixmaps keep square tiles of 1 << PIXMAP_TILE_SHIFT pixels a side
+#define PIXMAP_TILE_SHIFT 4
+
+/**
+ *    All the pixels are in a single mapping, either anonymous or of a PPM file
+ * right after its header. They are stored line after line, when pixels has
+ * the start of every line, or in tiles, when pixels is NULL, so that points
+ * close in the image are close in memory. A tile only gets the next free slot
+ * of the mapping when it is first drawn on, so sparse drawings use little
+ * memory.
+ */
 typedef struct {
 	int width, height;
 	pixel_t **pixels;
+	int tiles_per_line;
+	uint32_t *tile_slots; // slot of every tile plus 1, or 0 if not drawn on
+	uint32_t n_slots;
+	char *p_map;
+	size_t map_size;
 } pixmap_t;
 
 typedef pixel_t blend_f(pixel_t, pixel_t);
@@ -51,6 +67,23 @@ pixel_t blend_lighten(pixel_t a, pixel_t b);
  */
 int initialize_pixmap(pixmap_t *p_pixmap, int width, int height);
 
+/**
+ *    Same as initialize_pixmap, but the pixels are stored in tiles, which
+ * spares cache and TLB misses when drawing large images. The lines are
+ * gathered from the tiles when the pixmap is written.
+ *    @return PIXMAP_SUCCESS if successful or PIXMAP_ERROR otherwise
+ */
+int initialize_tiled_pixmap(pixmap_t *p_pixmap, int width, int height);
+
+/**
+ *    Same as initialize_pixmap, but the pixels are mapped from the given file,
+ * which is overwritten with a PPM image of the given size. The pixels drawn
+ * end up in the file without writing the pixmap.
+ *    @return PIXMAP_SUCCESS if successful or PIXMAP_ERROR otherwise
+ */
+int initialize_file_backed_pixmap(pixmap_t *p_pixmap, int width, int height,
+	char *path);
+
 /**
  *    Free the memory used by the given pixmap. After this operation the pixmap
  * should no longer be used.
@@ -59,16 +92,28 @@ int initialize_pixmap(pixmap_t *p_pixmap, int width, int height);
 int clear_pixmap(pixmap_t *p_pixmap);
 
 /**
- *    Write the given pixmap as a PBM (portable bitmap format).
+ *    Write the given pixmap as a PBM (portable bitmap format), with a single
+ * write for all the pixels unless they are tiled.
  *    @return PIXMAP_SUCCESS if successful or PIXMAP_ERROR otherwise
  */
 int write_pixmap(pixmap_t *p_pixmap, FILE *p_file);
 
+/**
+ *    Blend the pixels drawn on the given pixmaps, which have the size of
+ * p_pixmap, into p_pixmap with the given blending function, in the order of
+ * the pixmaps. The black pixels and the tiles not drawn on are skipped, so
+ * sparse tiled pixmaps are blended quickly. Only the part-th of n_parts bands
+ * of lines is blended. The bands start on the lines of tiles, so threads can
+ * blend different parts at the same time.
+ */
+void merge_pixmaps(pixmap_t *p_pixmap, pixmap_t *p_others, int n_others, int part,
+	int n_parts, blend_f *f);
+
 /**
  *    Color the given point (the size of a pixel). This will result in coloring
  * the neighbouring pixels in different ammounts. The blending mode indicated
  * by the given blending function will be used to blend the pixels with the
- * background.
+ * background. Points outside of the pixmap are clipped.
  */
 void color_point(pixmap_t *p_pixmap, double x, double y, pixel_t pixel, blend_f *f);
 